@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+// ways of sending one column of a row-major matrix
+enum column_method { VECTOR, SUBARRAY, MANUAL_PACK, MPI_PACK, N_METHODS };
+const char *method_names[N_METHODS] = {"MPI_Type_vector", "subarray", "manual pack", "MPI_Pack"};
+
+int main(int argc, char *argv[]) {
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    int size, rank;
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    // ranks work in pairs, a rank without a partner talks to itself
+    int partner = rank ^ 1;
+    if (partner >= size) {
+        partner = rank;
+    }
+
+    int n_repeats = 1000;
+    if (argc > 1) {
+        n_repeats = atoi(argv[1]);
+    }
+
+    // each matrix has a ghost column on the left, and a few more columns
+    // so that consecutive elements of a column are far apart in memory
+    const int n_columns = 64;
+    const int lengths[] = {16, 128, 1024, 8192, 65536};
+    const int n_lengths = sizeof(lengths) / sizeof(lengths[0]);
+
+    if (rank == 0) {
+        printf("Column exchange between pairs of %d ranks, %d round trips, matrix width %d\n",
+               size, n_repeats, n_columns);
+        printf("%10s", "length");
+        for (int method = 0; method < N_METHODS; method++) {
+            printf(" %18s", method_names[method]);
+        }
+        printf("   (us per exchange)\n");
+    }
+
+    int success = 1;
+    for (int l = 0; l < n_lengths; l++) {
+        const int n_rows = lengths[l];
+        double *matrix = malloc(sizeof(double) * n_rows * n_columns);
+        double *send_buffer = malloc(sizeof(double) * n_rows);
+        double *recv_buffer = malloc(sizeof(double) * n_rows);
+
+        // the datatypes are created and committed once, outside the timed
+        // loop, as they would be at the setup of a halo exchange
+
+        // n_rows blocks of one element, n_columns elements apart
+        MPI_Datatype vector_column;
+        MPI_Type_vector(n_rows, 1, n_columns, MPI_DOUBLE, &vector_column);
+        MPI_Type_commit(&vector_column);
+
+        // the same column, described as a n_rows x 1 piece of the matrix,
+        // starting at its first element
+        MPI_Datatype subarray_column;
+        int sizes[2] = {n_rows, n_columns};
+        int subsizes[2] = {n_rows, 1};
+        int starts[2] = {0, 0};
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE,
+                                 &subarray_column);
+        MPI_Type_commit(&subarray_column);
+
+        // MPI_Pack needs to know how big the packed column will be
+        int pack_size;
+        MPI_Pack_size(1, vector_column, comm, &pack_size);
+        char *pack_buffer = malloc(pack_size);
+        char *unpack_buffer = malloc(pack_size);
+
+        if (rank == 0) {
+            printf("%10d", n_rows);
+        }
+        for (int method = 0; method < N_METHODS; method++) {
+            // column 1 holds values that identify the sender, and
+            // column 0 is the ghost column that receives the partner's
+            for (int i = 0; i < n_rows; i++) {
+                for (int j = 0; j < n_columns; j++) {
+                    matrix[i * n_columns + j] = (j == 1) ? (double)(rank * n_rows + i) : -1.0;
+                }
+            }
+
+            MPI_Barrier(comm);
+            double start_time = MPI_Wtime();
+            for (int repeat = 0; repeat < n_repeats; repeat++) {
+                double *send_column = &matrix[1];
+                double *recv_column = &matrix[0];
+                if (method == VECTOR) {
+                    MPI_Sendrecv(send_column, 1, vector_column, partner, 0,
+                                 recv_column, 1, vector_column, partner, 0,
+                                 comm, MPI_STATUS_IGNORE);
+                } else if (method == SUBARRAY) {
+                    MPI_Sendrecv(send_column, 1, subarray_column, partner, 0,
+                                 recv_column, 1, subarray_column, partner, 0,
+                                 comm, MPI_STATUS_IGNORE);
+                } else if (method == MANUAL_PACK) {
+                    for (int i = 0; i < n_rows; i++) {
+                        send_buffer[i] = send_column[i * n_columns];
+                    }
+                    MPI_Sendrecv(send_buffer, n_rows, MPI_DOUBLE, partner, 0,
+                                 recv_buffer, n_rows, MPI_DOUBLE, partner, 0,
+                                 comm, MPI_STATUS_IGNORE);
+                    for (int i = 0; i < n_rows; i++) {
+                        recv_column[i * n_columns] = recv_buffer[i];
+                    }
+                } else {
+                    int position = 0;
+                    MPI_Pack(send_column, 1, vector_column, pack_buffer, pack_size, &position, comm);
+                    MPI_Sendrecv(pack_buffer, position, MPI_PACKED, partner, 0,
+                                 unpack_buffer, pack_size, MPI_PACKED, partner, 0,
+                                 comm, MPI_STATUS_IGNORE);
+                    position = 0;
+                    MPI_Unpack(unpack_buffer, pack_size, &position, recv_column, 1, vector_column, comm);
+                }
+            }
+            double elapsed = MPI_Wtime() - start_time;
+
+            // did the partner's column land in our ghost column, and
+            // nowhere else?
+            for (int i = 0; i < n_rows; i++) {
+                if (matrix[i * n_columns] != (double)(partner * n_rows + i) ||
+                    matrix[i * n_columns + 2] != -1.0) {
+                    success = 0;
+                }
+            }
+
+            double max_elapsed;
+            MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+            if (rank == 0) {
+                printf(" %18.3f", max_elapsed / n_repeats * 1e6);
+            }
+        }
+        if (rank == 0) {
+            printf("\n");
+        }
+
+        MPI_Type_free(&vector_column);
+        MPI_Type_free(&subarray_column);
+        free(matrix);
+        free(send_buffer);
+        free(recv_buffer);
+        free(pack_buffer);
+        free(unpack_buffer);
+    }
+
+    int all_success;
+    MPI_Reduce(&success, &all_success, 1, MPI_INT, MPI_LAND, 0, comm);
+    if (rank == 0) {
+        if (all_success) {
+            printf("SUCCESS on rank %d!\n", rank);
+        } else {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    MPI_Finalize();
+
+    return EXIT_SUCCESS;
+}
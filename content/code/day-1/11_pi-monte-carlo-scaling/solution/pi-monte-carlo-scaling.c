@@ -0,0 +1,912 @@
+/* A scalable version of ../../02_compute-pi/solution/pi-monte-carlo.c
+ *
+ * In server mode, the last ranks generate all the random numbers, as in
+ * the original exercise, but they push them to the checkers ahead of
+ * time, so the checkers don't wait for a round trip per chunk. In
+ * streams mode, every rank is a checker and generates its own random
+ * numbers with a counter-based generator, so no random numbers are sent
+ * at all.
+ *
+ * With --schedule static or steal, a fixed budget of samples is split
+ * into numbered blocks instead, each drawn from its own part of a
+ * stream that depends only on the seed. Every rank starts on an equal
+ * share of the blocks, and with steal, ranks that run out take blocks
+ * from the shares of the others through one-sided atomic operations.
+ *
+ * The batch kernels are OpenMP simd loops, which the compiler only
+ * vectorizes when asked to honour the pragma, and at -O3, eg
+ *
+ *   mpicc -O3 -fopenmp-simd pi-monte-carlo-scaling.c -lm   (SIMD)
+ *   mpicc -O3 -fopenmp pi-monte-carlo-scaling.c -lm        (SIMD and threads)
+ *
+ * Without either flag the pragmas are ignored, with a warning, and the
+ * batch kernels are plain loops.
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define PI 3.141592653589793238462643
+
+// default number of random numbers per chunk, ie half as many samples
+#define CHUNKSIZE 1000
+
+// default number of chunks in flight to each checker in server mode
+#define DEPTH 3
+
+// by default, stop anyway after this many samples
+#define MAX_SAMPLES 100000000
+
+// by default, check for convergence after every this many chunks
+#define CHECK_INTERVAL 8
+
+// why a run stopped
+enum stop_reason { NOT_STOPPED, CONVERGED, SAMPLE_BUDGET, TIME_BUDGET };
+const char *stop_reason_names[] = {"running", "converged", "sample budget", "time budget"};
+
+// where a checker spends its time: getting random numbers, from the
+// server or the generator, testing them, and combining the counts.
+// The fused batch kernel of streams mode generates and tests in one
+// go, which all counts as compute.
+enum checker_phase { RNG, COMPUTE, REDUCTION, SCHEDULING, N_CHECKER_PHASES };
+const char *checker_phase_names[] = {"rng", "compute", "reduction", "scheduling"};
+
+// how work is shared: chunks in lockstep with convergence checks, or
+// blocks of a sample budget, either split evenly or with work stealing
+enum schedule { LOCKSTEP, STATIC, STEAL };
+const char *schedule_names[] = {"lockstep", "static", "steal"};
+
+/* message tags */
+#define REQUEST 1
+#define REPLY 2
+
+enum rng_mode { SERVER, STREAMS };
+const char *rng_mode_names[] = {"server", "streams"};
+
+// the original loop over one sample at a time, or a batch that is a
+// SIMD loop when built with -fopenmp-simd or -fopenmp, and that is
+// shared by OpenMP threads when built with -fopenmp
+enum kernel { SCALAR, BATCH };
+const char *kernel_names[] = {"scalar", "batch"};
+
+// batches smaller than this many samples are not worth sharing between
+// threads
+#define MIN_THREADED_SAMPLES 8192
+
+// number of samples per rank to compare the kernels on
+#define KERNEL_BENCHMARK_SAMPLES (1 << 21)
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1,
+// 2, 3", SC11) turns a 128-bit counter and a 64-bit key into 128 random
+// bits. Every checker uses its own key, made from the seed and its rank,
+// and counts up from 0, so each has an independent stream that can be
+// reproduced without any state but the counter.
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static inline void philox4x32_10(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        const uint64_t product0 = (uint64_t)PHILOX_M0 * c0;
+        const uint64_t product1 = (uint64_t)PHILOX_M1 * c2;
+        const uint32_t hi0 = (uint32_t)(product0 >> 32), lo0 = (uint32_t)product0;
+        const uint32_t hi1 = (uint32_t)(product1 >> 32), lo1 = (uint32_t)product1;
+        c0 = hi1 ^ c1 ^ k0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ k1;
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// map 32 random bits to [-1, 1), through a signed conversion, which
+// unlike an unsigned one has a vector instruction everywhere
+static inline double to_symmetric_unit(uint32_t bits) {
+    return (double)(int32_t)bits * (1.0 / 2147483648.0);
+}
+
+struct rng_stream {
+    uint32_t key[2];
+    uint64_t position;
+};
+
+static void stream_init(struct rng_stream *stream, uint32_t seed, int rank) {
+    stream->key[0] = (uint32_t)rank;
+    stream->key[1] = seed;
+    stream->position = 0;
+}
+
+// fill rands with the next n numbers of the stream, n a multiple of 4
+static void stream_fill(struct rng_stream *stream, double *rands, int n) {
+    for (int i = 0; i < n; i += 4) {
+        const uint32_t counter[4] = {(uint32_t)stream->position, (uint32_t)(stream->position >> 32), 0, 0};
+        uint32_t bits[4];
+        philox4x32_10(counter, stream->key, bits);
+        for (int k = 0; k < 4; k++) {
+            rands[i + k] = to_symmetric_unit(bits[k]);
+        }
+        stream->position++;
+    }
+}
+
+// the original test, one sample at a time, where sample i is at x[i *
+// stride] and y[i * stride]
+static void count_scalar(const double *x, const double *y, int stride, int n, int64_t *in, int64_t *out) {
+    for (int i = 0; i < n; i++) {
+        double sample_x = x[i * stride];
+        double sample_y = y[i * stride];
+        if (sample_x * sample_x + sample_y * sample_y < 1.0) {
+            (*in)++;
+        } else {
+            (*out)++;
+        }
+    }
+}
+
+// count how many of n samples, with coordinates in separate arrays, are
+// inside the circle. The comparison is added rather than branched on,
+// so that the loop can be vectorized.
+static int64_t count_batch(const double *restrict x, const double *restrict y, int n) {
+    int64_t count = 0;
+#ifdef _OPENMP
+#pragma omp parallel for simd reduction(+ : count) schedule(static) if (n >= MIN_THREADED_SAMPLES)
+#else
+#pragma omp simd reduction(+ : count)
+#endif
+    for (int i = 0; i < n; i++) {
+        count += (x[i] * x[i] + y[i] * y[i] < 1.0);
+    }
+    return count;
+}
+
+// count how many of the samples from the next n_blocks outputs of the
+// stream are inside the circle, each output giving two samples. The
+// random numbers are generated in registers and never stored, and the
+// samples are the same as from stream_fill, so the count matches the
+// scalar kernel exactly.
+static int64_t count_batch_stream(struct rng_stream *stream, int64_t n_blocks) {
+    const uint64_t first_position = stream->position;
+    const uint32_t key[2] = {stream->key[0], stream->key[1]};
+    int64_t count = 0;
+#ifdef _OPENMP
+#pragma omp parallel for simd reduction(+ : count) schedule(static) if (2 * n_blocks >= MIN_THREADED_SAMPLES)
+#else
+#pragma omp simd reduction(+ : count)
+#endif
+    for (int64_t b = 0; b < n_blocks; b++) {
+        const uint64_t position = first_position + (uint64_t)b;
+        const uint32_t counter[4] = {(uint32_t)position, (uint32_t)(position >> 32), 0, 0};
+        uint32_t bits[4];
+        philox4x32_10(counter, key, bits);
+        const double x0 = to_symmetric_unit(bits[0]), y0 = to_symmetric_unit(bits[1]);
+        const double x1 = to_symmetric_unit(bits[2]), y1 = to_symmetric_unit(bits[3]);
+        count += (x0 * x0 + y0 * y0 < 1.0) + (x1 * x1 + y1 * y1 < 1.0);
+    }
+    stream->position += (uint64_t)n_blocks;
+    return count;
+}
+
+// time both kernels on the same samples of a stream on each checker,
+// and give the samples per second per core, ie per thread, of the
+// slowest checker. Returns whether both kernels counted the same.
+static int compare_kernels(uint32_t seed, int rank, int n_threads, MPI_Comm checkers, double rates[2]) {
+    const int n_blocks = KERNEL_BENCHMARK_SAMPLES / 2;
+    double *rands = malloc(sizeof(double) * 4 * n_blocks);
+    struct rng_stream stream;
+    int64_t scalar_in = 0, scalar_out = 0, batch_in;
+    double times[2], max_times[2];
+
+    // a part of the stream that the run itself won't reach
+    stream_init(&stream, seed, rank);
+    stream.position = UINT64_C(1) << 62;
+    double start_time = MPI_Wtime();
+    stream_fill(&stream, rands, 4 * n_blocks);
+    count_scalar(rands, rands + 1, 2, 2 * n_blocks, &scalar_in, &scalar_out);
+    times[0] = MPI_Wtime() - start_time;
+
+    stream.position = UINT64_C(1) << 62;
+    start_time = MPI_Wtime();
+    batch_in = count_batch_stream(&stream, n_blocks);
+    times[1] = MPI_Wtime() - start_time;
+    free(rands);
+
+    int same = (scalar_in == batch_in), all_same;
+    MPI_Allreduce(times, max_times, 2, MPI_DOUBLE, MPI_MAX, checkers);
+    MPI_Allreduce(&same, &all_same, 1, MPI_INT, MPI_LAND, checkers);
+    rates[SCALAR] = 2.0 * n_blocks / max_times[0];
+    rates[BATCH] = 2.0 * n_blocks / max_times[1] / n_threads;
+    return all_same;
+}
+
+// in server mode, the random number servers are the last n_servers
+// ranks, and checker c is served by server c % n_servers
+static int server_of_checker(int checker, int size, int n_servers) {
+    return size - n_servers + checker % n_servers;
+}
+
+// a server keeps depth chunks in flight to each of its checkers
+struct server_state {
+    int n_checkers, first_checker, n_servers, chunk_size, depth;
+    double *buffers;
+    MPI_Request *requests;
+    long *n_sent;
+};
+
+// fill the oldest buffer of a checker with fresh random data, once the
+// previous send from it is complete, and send it on its way. The first
+// half of a chunk holds the x coordinates, and the second half the y
+// coordinates, ready for the batch kernel.
+static void push_chunk(struct server_state *server, int m, MPI_Comm world) {
+    int slot = m * server->depth + (int)(server->n_sent[m] % server->depth);
+    double *buffer = server->buffers + (size_t)slot * server->chunk_size;
+    MPI_Wait(&server->requests[slot], MPI_STATUS_IGNORE);
+    for (int i = 0; i < server->chunk_size; ++i) {
+        buffer[i] = (double)rand() / RAND_MAX * 2.0 - 1.0;
+    }
+    int checker = server->first_checker + m * server->n_servers;
+    MPI_Isend(buffer, server->chunk_size, MPI_DOUBLE, checker, REPLY, world, &server->requests[slot]);
+    server->n_sent[m]++;
+}
+
+// a server pushes depth chunks to each of its checkers straight away,
+// and then one more whenever a checker reports that it has used one,
+// so that the checkers find their next chunk already waiting. It stops
+// when all its checkers have told it that they are done.
+static void run_server(int server_index, int n_servers, int n_checkers, int chunk_size, int depth,
+                       MPI_Comm world) {
+    struct server_state server;
+    server.n_checkers = 0;
+    for (int c = server_index; c < n_checkers; c += n_servers) {
+        server.n_checkers++;
+    }
+    server.first_checker = server_index;
+    server.n_servers = n_servers;
+    server.chunk_size = chunk_size;
+    server.depth = depth;
+    int n_slots = server.n_checkers * depth;
+    server.buffers = malloc(sizeof(double) * chunk_size * n_slots);
+    server.requests = malloc(sizeof(MPI_Request) * n_slots);
+    server.n_sent = calloc(server.n_checkers, sizeof(long));
+    for (int slot = 0; slot < n_slots; slot++) {
+        server.requests[slot] = MPI_REQUEST_NULL;
+    }
+
+    for (int d = 0; d < depth; d++) {
+        for (int m = 0; m < server.n_checkers; m++) {
+            push_chunk(&server, m, world);
+        }
+    }
+    int n_running = server.n_checkers;
+    while (n_running > 0) {
+        int request;
+        MPI_Status status;
+        MPI_Recv(&request, 1, MPI_INT, MPI_ANY_SOURCE, REQUEST, world, &status);
+        int m = status.MPI_SOURCE / n_servers;
+        if (request) {
+            push_chunk(&server, m, world);
+        } else {
+            n_running--;
+        }
+    }
+
+    MPI_Waitall(n_slots, server.requests, MPI_STATUSES_IGNORE);
+    free(server.buffers);
+    free(server.requests);
+    free(server.n_sent);
+}
+
+// a checker always has depth receives posted for chunks from its
+// server. Messages from one source with one tag match the receives in
+// the order they were posted, so the oldest receive gets the next chunk.
+struct chunk_queue {
+    int server_rank, chunk_size, depth;
+    long n_received;
+    double *buffers;
+    MPI_Request *requests;
+};
+
+static void queue_init(struct chunk_queue *queue, int server_rank, int chunk_size, int depth, MPI_Comm world) {
+    queue->server_rank = server_rank;
+    queue->chunk_size = chunk_size;
+    queue->depth = depth;
+    queue->n_received = 0;
+    queue->buffers = malloc(sizeof(double) * chunk_size * depth);
+    queue->requests = malloc(sizeof(MPI_Request) * depth);
+    for (int d = 0; d < depth; d++) {
+        MPI_Irecv(queue->buffers + (size_t)d * chunk_size, chunk_size, MPI_DOUBLE, server_rank, REPLY, world,
+                  &queue->requests[d]);
+    }
+}
+
+// wait for the next chunk, which stays valid until queue_release
+static double *queue_next(struct chunk_queue *queue) {
+    int slot = (int)(queue->n_received % queue->depth);
+    MPI_Wait(&queue->requests[slot], MPI_STATUS_IGNORE);
+    queue->n_received++;
+    return queue->buffers + (size_t)slot * queue->chunk_size;
+}
+
+// hand the last chunk back, and either ask the server for another, or
+// tell it to stop and receive the chunks that are still on their way
+static void queue_release(struct chunk_queue *queue, int more, MPI_Comm world) {
+    int request = more;
+    MPI_Send(&request, 1, MPI_INT, queue->server_rank, REQUEST, world);
+    if (more) {
+        int slot = (int)((queue->n_received - 1) % queue->depth);
+        MPI_Irecv(queue->buffers + (size_t)slot * queue->chunk_size, queue->chunk_size, MPI_DOUBLE,
+                  queue->server_rank, REPLY, world, &queue->requests[slot]);
+    } else {
+        MPI_Waitall(queue->depth, queue->requests, MPI_STATUSES_IGNORE);
+    }
+}
+
+static void queue_free(struct chunk_queue *queue) {
+    free(queue->buffers);
+    free(queue->requests);
+}
+
+// split n blocks over n_parts parts as evenly as possible, and give the
+// first block of the given part, and the first one after it
+static void decompose_blocks(int64_t n, int n_parts, int part, int64_t *first, int64_t *end) {
+    int64_t base = n / n_parts, remainder = n % n_parts;
+    *first = part * base + ((part < remainder) ? part : remainder);
+    *end = *first + base + ((part < remainder) ? 1 : 0);
+}
+
+// every rank exposes the number of the next block of its share in a
+// window. The owner and any thief take blocks with MPI_Fetch_and_op,
+// so a block is never taken twice. A counter that has passed the end
+// of its share stays past it, so a rank that was found empty never
+// needs to be tried again.
+//
+// Unless the window is in shared memory, an MPI library may emulate
+// the atomics with messages that the target handles only when it next
+// calls MPI, so a thief waits on a busy owner, and the owner pays a
+// round trip for each of its own blocks. So when all the ranks share a
+// node, the window is allocated in shared memory, where the atomics
+// are the processor's own. Otherwise the owner claims a part of what is
+// left of its share at a time, as in guided scheduling, and thieves
+// still take one block at a time.
+struct block_scheduler {
+    MPI_Win window;
+    int64_t *next_block;
+    int64_t n_blocks;
+    int size, rank, steal, shared;
+    // the blocks of this rank's share it has claimed but not yet taken
+    int64_t claimed, claim_end;
+    // how far along the ranks after this one we are looking for work
+    int victim_offset;
+    int64_t n_taken, n_stolen;
+};
+
+static void scheduler_init(struct block_scheduler *scheduler, int64_t n_blocks, int steal, MPI_Comm comm) {
+    MPI_Comm_size(comm, &scheduler->size);
+    MPI_Comm_rank(comm, &scheduler->rank);
+    scheduler->n_blocks = n_blocks;
+    scheduler->steal = steal;
+    scheduler->victim_offset = 0;
+    scheduler->claimed = scheduler->claim_end = 0;
+    scheduler->n_taken = scheduler->n_stolen = 0;
+
+    MPI_Comm node_comm;
+    int node_size;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &node_size);
+    MPI_Comm_free(&node_comm);
+    scheduler->shared = (node_size == scheduler->size);
+    if (scheduler->shared) {
+        MPI_Win_allocate_shared(sizeof(int64_t), sizeof(int64_t), MPI_INFO_NULL, comm, &scheduler->next_block,
+                                &scheduler->window);
+    } else {
+        MPI_Win_allocate(sizeof(int64_t), sizeof(int64_t), MPI_INFO_NULL, comm, &scheduler->next_block,
+                         &scheduler->window);
+    }
+
+    // a barrier alone does not make our store to the window visible to
+    // the atomics of other ranks, so store within the epoch, then sync
+    // the window before the barrier
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, scheduler->window);
+    int64_t end;
+    decompose_blocks(n_blocks, scheduler->size, scheduler->rank, scheduler->next_block, &end);
+    MPI_Win_sync(scheduler->window);
+    MPI_Barrier(comm);
+}
+
+// take the next block of this rank's share, or when that is empty and
+// stealing is on, of the next rank along that still has work. Returns
+// -1 when there is nothing left to do.
+static int64_t scheduler_next(struct block_scheduler *scheduler) {
+    if (scheduler->claimed < scheduler->claim_end) {
+        scheduler->n_taken++;
+        return scheduler->claimed++;
+    }
+    while (scheduler->victim_offset < scheduler->size) {
+        int target = (scheduler->rank + scheduler->victim_offset) % scheduler->size;
+        int64_t block, first, end, count = 1;
+        decompose_blocks(scheduler->n_blocks, scheduler->size, target, &first, &end);
+        if (target == scheduler->rank && !scheduler->shared) {
+            // what was left at the last claim is all we know of
+            int64_t left = end - ((scheduler->claim_end > first) ? scheduler->claim_end : first);
+            count = left / (2 * scheduler->size);
+            if (count < 1) {
+                count = 1;
+            }
+        }
+        MPI_Fetch_and_op(&count, &block, MPI_INT64_T, target, 0, MPI_SUM, scheduler->window);
+        MPI_Win_flush(target, scheduler->window);
+        if (block < end) {
+            scheduler->n_taken++;
+            if (target != scheduler->rank) {
+                scheduler->n_stolen++;
+            } else {
+                scheduler->claimed = block + 1;
+                scheduler->claim_end = (block + count < end) ? block + count : end;
+            }
+            return block;
+        }
+        if (!scheduler->steal) {
+            break;
+        }
+        scheduler->victim_offset++;
+    }
+    return -1;
+}
+
+static void scheduler_free(struct block_scheduler *scheduler) {
+    MPI_Win_unlock_all(scheduler->window);
+    MPI_Win_free(&scheduler->window);
+}
+
+// check blocks of chunk_size random numbers, ie chunk_size / 2 samples,
+// until there are none left. Block b is always the same part of the
+// same stream, whichever rank checks it, so the result depends only on
+// the seed and the budget. To emulate a slower core, each block can be
+// checked several times over.
+static void run_blocks(int64_t n_blocks, int steal, uint32_t seed, int chunk_size, enum kernel kernel,
+                       int repeats, double progress_interval, MPI_Comm checkers, int64_t *in, int64_t *out,
+                       double phase_times[N_CHECKER_PHASES], int64_t *n_taken, int64_t *n_stolen) {
+    struct block_scheduler scheduler;
+    scheduler_init(&scheduler, n_blocks, steal, checkers);
+
+    // one stream for the whole budget, with a key that no rank has
+    struct rng_stream stream;
+    stream_init(&stream, seed, 0);
+    stream.key[0] = UINT32_MAX;
+    const int blocks_per_chunk = chunk_size / 4, n_samples = chunk_size / 2;
+    double *rands = malloc(sizeof(double) * chunk_size);
+    double start_time = MPI_Wtime(), last_progress = start_time;
+
+    *in = *out = 0;
+    while (1) {
+        double phase_start = MPI_Wtime();
+        int64_t block = scheduler_next(&scheduler);
+        double scheduling_end = MPI_Wtime();
+        phase_times[SCHEDULING] += scheduling_end - phase_start;
+        if (block < 0) {
+            break;
+        }
+        for (int r = 0; r < repeats; r++) {
+            int64_t block_in = 0, block_out = 0;
+            phase_start = MPI_Wtime();
+            stream.position = (uint64_t)block * blocks_per_chunk;
+            if (kernel == BATCH) {
+                block_in = count_batch_stream(&stream, blocks_per_chunk);
+                block_out = n_samples - block_in;
+            } else {
+                stream_fill(&stream, rands, chunk_size);
+                double rng_end = MPI_Wtime();
+                phase_times[RNG] += rng_end - phase_start;
+                phase_start = rng_end;
+                count_scalar(rands, rands + 1, 2, n_samples, &block_in, &block_out);
+            }
+            phase_times[COMPUTE] += MPI_Wtime() - phase_start;
+            if (r == 0) {
+                *in += block_in;
+                *out += block_out;
+            }
+        }
+
+        // there is no global count until the end, so the first checker
+        // reports on its own share
+        if (scheduler.rank == 0 && progress_interval > 0 && scheduling_end - last_progress >= progress_interval) {
+            fprintf(stderr, "progress: %.3f s, rank 0 has checked %" PRId64 " blocks, %" PRId64 " of them stolen\n",
+                    scheduling_end - start_time, scheduler.n_taken, scheduler.n_stolen);
+            last_progress = scheduling_end;
+        }
+    }
+
+    *n_taken = scheduler.n_taken;
+    *n_stolen = scheduler.n_stolen;
+    free(rands);
+    scheduler_free(&scheduler);
+}
+
+// the index of value in names, or -1 if it is none of them
+static int parse_choice(const char *value, const char *names[], int n_names) {
+    for (int k = 0; k < n_names; k++) {
+        if (strcmp(value, names[k]) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    // counter for the number of samples inside and outside the circle
+    int64_t in, out;
+    // total tally of samples inside and outside the circle
+    int64_t totalin = 0, totalout = 0;
+    // current estimate of pi
+    double Pi = 0.0;
+    // error and user-provided threshold
+    double error = 0.0, epsilon = 0.0;
+    // whether and why the run is over
+    enum stop_reason done = NOT_STOPPED;
+    int size, rank;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm world = MPI_COMM_WORLD;
+
+    MPI_Comm_size(world, &size);
+    MPI_Comm_rank(world, &rank);
+
+    // read user input, every rank sees the same command line. Without an
+    // epsilon, only the budgets end the run.
+    enum rng_mode mode = STREAMS;
+    enum kernel kernel = BATCH;
+    int chunk_size = CHUNKSIZE, depth = DEPTH, n_servers = 1;
+    enum schedule schedule = LOCKSTEP;
+    int check_interval = CHECK_INTERVAL, adaptive = 0, batch = 0, imbalance = 1;
+    int64_t max_samples = MAX_SAMPLES;
+    double time_limit = 0.0, progress_interval = 0.0;
+    uint32_t seed = 2024;
+    int bad_usage = 0;
+    int first_option = 1;
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+        epsilon = atof(argv[1]);
+        first_option = 2;
+    }
+    for (int k = first_option; k < argc; k++) {
+        if (strcmp(argv[k], "--mode") == 0 && k + 1 < argc) {
+            const int choice = parse_choice(argv[k + 1], rng_mode_names, 2);
+            if (choice < 0) {
+                bad_usage = 1;
+            } else {
+                mode = (enum rng_mode)choice;
+            }
+            k++;
+        } else if (strcmp(argv[k], "--chunk") == 0 && k + 1 < argc) {
+            chunk_size = atoi(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--kernel") == 0 && k + 1 < argc) {
+            const int choice = parse_choice(argv[k + 1], kernel_names, 2);
+            if (choice < 0) {
+                bad_usage = 1;
+            } else {
+                kernel = (enum kernel)choice;
+            }
+            k++;
+        } else if (strcmp(argv[k], "--depth") == 0 && k + 1 < argc) {
+            depth = atoi(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--servers") == 0 && k + 1 < argc) {
+            n_servers = atoi(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--check-every") == 0 && k + 1 < argc) {
+            check_interval = atoi(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--adaptive") == 0) {
+            adaptive = 1;
+        } else if ((strcmp(argv[k], "--max-samples") == 0 || strcmp(argv[k], "--samples") == 0) && k + 1 < argc) {
+            max_samples = (int64_t)strtod(argv[k + 1], NULL);
+            k++;
+        } else if (strcmp(argv[k], "--time") == 0 && k + 1 < argc) {
+            time_limit = atof(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--progress") == 0 && k + 1 < argc) {
+            progress_interval = atof(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--schedule") == 0 && k + 1 < argc) {
+            const int choice = parse_choice(argv[k + 1], schedule_names, 3);
+            if (choice < 0) {
+                bad_usage = 1;
+            } else {
+                schedule = (enum schedule)choice;
+            }
+            k++;
+        } else if (strcmp(argv[k], "--imbalance") == 0 && k + 1 < argc) {
+            imbalance = atoi(argv[k + 1]);
+            k++;
+        } else if (strcmp(argv[k], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[k], "--seed") == 0 && k + 1 < argc) {
+            seed = (uint32_t)strtoul(argv[k + 1], NULL, 10);
+            k++;
+        } else {
+            bad_usage = 1;
+        }
+    }
+    if (mode == STREAMS) {
+        n_servers = 0;
+    }
+    // the chunk holds whole outputs of the generator
+    if (bad_usage || chunk_size < 4 || chunk_size % 4 != 0 || depth < 1 || n_servers < 0 ||
+        check_interval < 1 || max_samples < 1 || time_limit < 0 || progress_interval < 0 || imbalance < 1 ||
+        (mode == SERVER && (n_servers < 1 || n_servers >= size)) ||
+        (schedule != LOCKSTEP && (mode == SERVER || epsilon > 0 || time_limit > 0))) {
+        if (rank == 0) {
+            fprintf(stderr, "Usage: %s [epsilon] [--mode streams|server] [--chunk N] [--seed S]\n"
+                            "       [--depth D] [--servers S] [--check-every K] [--adaptive]\n"
+                            "       [--samples M] [--time T] [--progress P] [--batch]\n"
+                            "       [--kernel batch|scalar] [--schedule lockstep|static|steal] [--imbalance F]\n"
+                            "N is a multiple of 4, and server mode needs more ranks than servers.\n"
+                            "The static and steal schedules run in streams mode to a sample budget.\n",
+                    argv[0]);
+        }
+        MPI_Abort(world, 1);
+    }
+
+    // in server mode, we use the last n_servers processes as random
+    // number servers, and the others are checkers, while in streams mode
+    // all processes are checkers
+    int n_checkers = size - n_servers;
+    int is_checker = (rank < n_checkers);
+    MPI_Comm checkers;
+    MPI_Comm_split(world, is_checker ? 0 : MPI_UNDEFINED, rank, &checkers);
+
+    // each server has its own sequence of random numbers
+    struct rng_stream stream;
+    stream_init(&stream, seed, rank);
+    srand(seed + (uint32_t)(rank - n_checkers));
+
+    int n_threads = 1;
+#ifdef _OPENMP
+    n_threads = omp_get_max_threads();
+#endif
+    int kernels_agree = 1;
+    double kernel_rates[2] = {0.0, 0.0};
+    if (is_checker) {
+        kernels_agree = compare_kernels(seed, rank, n_threads, checkers, kernel_rates);
+    }
+
+    MPI_Barrier(world);
+    double start_time = MPI_Wtime();
+    double phase_sums[N_CHECKER_PHASES] = {0.0}, phase_maxima[N_CHECKER_PHASES] = {0.0};
+    int64_t n_drawn = 0;
+    int64_t n_blocks = 0, n_stolen = 0, blocks_min = 0, blocks_max = 0;
+
+    // with --imbalance F, the odd ranks take F times as long per sample
+    int repeats = (rank % 2 == 1) ? imbalance : 1;
+
+    // handle the random number generation
+    if (!is_checker) { /* I am a random number generator */
+        run_server(rank - n_checkers, n_servers, n_checkers, chunk_size, depth, world);
+    } else if (schedule != LOCKSTEP) { /* I am a checker working through a budget */
+        double phase_times[N_CHECKER_PHASES] = {0.0};
+        int64_t my_blocks, my_stolen;
+        n_blocks = (max_samples + chunk_size / 2 - 1) / (chunk_size / 2);
+        run_blocks(n_blocks, schedule == STEAL, seed, chunk_size, kernel, repeats, progress_interval, checkers, &in,
+                   &out, phase_times, &my_blocks, &my_stolen);
+
+        // the only reduction of the counts is at the end
+        double reduction_start = MPI_Wtime();
+        int64_t counts[2] = {in, out}, totals[2];
+        MPI_Allreduce(counts, totals, 2, MPI_INT64_T, MPI_SUM, checkers);
+        phase_times[REDUCTION] += MPI_Wtime() - reduction_start;
+        totalin = totals[0];
+        totalout = totals[1];
+        Pi = (4.0 * totalin) / (totalin + totalout);
+        error = fabs(Pi - PI);
+        done = SAMPLE_BUDGET;
+        n_drawn = totalin + totalout;
+
+        MPI_Reduce(&my_stolen, &n_stolen, 1, MPI_INT64_T, MPI_SUM, 0, checkers);
+        MPI_Reduce(&my_blocks, &blocks_min, 1, MPI_INT64_T, MPI_MIN, 0, checkers);
+        MPI_Reduce(&my_blocks, &blocks_max, 1, MPI_INT64_T, MPI_MAX, 0, checkers);
+        MPI_Reduce(phase_times, phase_sums, N_CHECKER_PHASES, MPI_DOUBLE, MPI_SUM, 0, checkers);
+        MPI_Reduce(phase_times, phase_maxima, N_CHECKER_PHASES, MPI_DOUBLE, MPI_MAX, 0, checkers);
+
+        // clean up!
+        MPI_Comm_free(&checkers);
+    } else { /* I am a checker process */
+        // first thing, a checker process in server mode gets its
+        // receives for random data posted
+        struct chunk_queue queue = {0};
+        double *rands = NULL;
+        if (mode == SERVER) {
+            queue_init(&queue, server_of_checker(rank, size, n_servers), chunk_size, depth, world);
+        } else {
+            rands = malloc(sizeof(double) * chunk_size);
+        }
+        in = out = 0;
+        double phase_times[N_CHECKER_PHASES] = {0.0};
+        double last_progress = 0.0;
+        // the counts are reduced with a single non-blocking reduction,
+        // started at a check point and only waited for at the next, so
+        // the checkers keep working while it is in flight. The check
+        // points come every check_interval chunks, or with --adaptive,
+        // after 1, 2, 4, ... chunks up to check_interval, so that easy
+        // targets are still noticed early. They don't depend on timing,
+        // so every checker makes the same decisions. For the same reason,
+        // the time budget is checked against the elapsed time, in
+        // microseconds, summed over the checkers in the same reduction.
+        int64_t counts[3], totals[3];
+        MPI_Request reduction = MPI_REQUEST_NULL;
+        int interval = adaptive ? 1 : check_interval;
+        int64_t n_chunks = 0, next_check = interval;
+        // check the random samples
+        while (!done) {
+            int n_samples = chunk_size / 2;
+            double phase_start = MPI_Wtime();
+            if (mode == SERVER) {
+                rands = queue_next(&queue);
+                double rng_end = MPI_Wtime();
+                phase_times[RNG] += rng_end - phase_start;
+                phase_start = rng_end;
+                if (kernel == BATCH) {
+                    int64_t n_in = count_batch(rands, rands + n_samples, n_samples);
+                    in += n_in;
+                    out += n_samples - n_in;
+                } else {
+                    count_scalar(rands, rands + n_samples, 1, n_samples, &in, &out);
+                }
+            } else if (kernel == BATCH) {
+                int64_t n_in = count_batch_stream(&stream, chunk_size / 4);
+                in += n_in;
+                out += n_samples - n_in;
+            } else {
+                stream_fill(&stream, rands, chunk_size);
+                double rng_end = MPI_Wtime();
+                phase_times[RNG] += rng_end - phase_start;
+                phase_start = rng_end;
+                count_scalar(rands, rands + 1, 2, n_samples, &in, &out);
+            }
+            double compute_end = MPI_Wtime();
+            phase_times[COMPUTE] += compute_end - phase_start;
+
+            n_chunks++;
+
+            if (n_chunks == next_check) {
+                // total tally of points inside and outside the circle, as
+                // of the previous check point
+                if (reduction != MPI_REQUEST_NULL) {
+                    MPI_Wait(&reduction, MPI_STATUS_IGNORE);
+                    totalin = totals[0];
+                    totalout = totals[1];
+
+                    // compute pi, and check the error
+                    Pi = (4.0 * totalin) / (totalin + totalout);
+                    error = fabs(Pi - PI);
+
+                    // are we done?
+                    if (error < epsilon) {
+                        done = CONVERGED;
+                    } else if (totalin + totalout >= max_samples) {
+                        done = SAMPLE_BUDGET;
+                    } else if (time_limit > 0 && totals[2] * 1e-6 / n_checkers >= time_limit) {
+                        done = TIME_BUDGET;
+                    }
+                }
+                if (!done) {
+                    counts[0] = in;
+                    counts[1] = out;
+                    counts[2] = (int64_t)((compute_end - start_time) * 1e6);
+                    MPI_Iallreduce(counts, totals, 3, MPI_INT64_T, MPI_SUM, checkers, &reduction);
+                }
+                if (adaptive && interval < check_interval) {
+                    interval = (2 * interval < check_interval) ? 2 * interval : check_interval;
+                }
+                next_check += interval;
+                phase_times[REDUCTION] += MPI_Wtime() - compute_end;
+
+                // the progress report is just for watching, so only the
+                // first checker decides when to write it
+                if (rank == 0 && progress_interval > 0 && compute_end - last_progress >= progress_interval &&
+                    totalin + totalout > 0) {
+                    fprintf(stderr, "progress: %.3f s, %" PRId64 " samples, pi = %.12f, error: %.3e\n",
+                            compute_end - start_time, totalin + totalout, Pi, error);
+                    last_progress = compute_end;
+                }
+            }
+
+            // ask for a new chunk, or tell the server to stop
+            if (mode == SERVER) {
+                queue_release(&queue, !done, world);
+            }
+        }
+
+        // the samples drawn after the last check point were not part of
+        // the estimate, but still count towards the throughput
+        int64_t my_drawn = in + out;
+        MPI_Reduce(&my_drawn, &n_drawn, 1, MPI_INT64_T, MPI_SUM, 0, checkers);
+        MPI_Reduce(phase_times, phase_sums, N_CHECKER_PHASES, MPI_DOUBLE, MPI_SUM, 0, checkers);
+        MPI_Reduce(phase_times, phase_maxima, N_CHECKER_PHASES, MPI_DOUBLE, MPI_MAX, 0, checkers);
+
+        if (mode == SERVER) {
+            queue_free(&queue);
+        } else {
+            free(rands);
+        }
+
+        // clean up!
+        MPI_Comm_free(&checkers);
+    }
+    double elapsed = MPI_Wtime() - start_time;
+
+    // print results, in batch mode as a single line of JSON
+    if (rank == 0) {
+        int64_t n_points = totalin + totalout;
+        double samples_per_second = n_drawn / elapsed;
+        double samples_per_core = samples_per_second / n_checkers / n_threads;
+        if (batch) {
+            printf("{\"mode\": \"%s\", \"kernel\": \"%s\", \"checkers\": %d, \"servers\": %d, "
+                   "\"threads\": %d, \"chunk\": %d, \"seed\": %u, \"epsilon\": %g, "
+                   "\"stop\": \"%s\", \"pi\": %.17g, \"error\": %.6e, \"samples_checked\": %" PRId64 ", "
+                   "\"samples\": %" PRId64 ", \"time\": %.6f, \"samples_per_second\": %.6g, "
+                   "\"samples_per_second_per_core\": %.6g, \"scalar_kernel_per_core\": %.6g, "
+                   "\"batch_kernel_per_core\": %.6g, \"kernels_agree\": %s, \"schedule\": \"%s\", "
+                   "\"imbalance\": %d",
+                   rng_mode_names[mode], kernel_names[kernel], n_checkers, n_servers, n_threads, chunk_size, seed,
+                   epsilon, stop_reason_names[done], Pi, error, n_points, n_drawn, elapsed, samples_per_second,
+                   samples_per_core, kernel_rates[SCALAR], kernel_rates[BATCH], kernels_agree ? "true" : "false",
+                   schedule_names[schedule], imbalance);
+            if (schedule != LOCKSTEP) {
+                printf(", \"blocks\": %" PRId64 ", \"blocks_stolen\": %" PRId64 ", "
+                       "\"blocks_per_checker\": {\"min\": %" PRId64 ", \"max\": %" PRId64 "}",
+                       n_blocks, n_stolen, blocks_min, blocks_max);
+            }
+            for (int p = 0; p < N_CHECKER_PHASES; p++) {
+                printf(", \"%s_time\": {\"avg\": %.6f, \"max\": %.6f}", checker_phase_names[p],
+                       phase_sums[p] / n_checkers, phase_maxima[p]);
+            }
+            printf("}\n");
+        } else {
+            printf("mode: %s, seed: %u, chunk: %d, checkers: %d\n", rng_mode_names[mode], seed, chunk_size,
+                   n_checkers);
+            printf("checking every %d chunks%s, %s kernel on %d threads per checker\n", check_interval,
+                   adaptive ? " at most" : "", kernel_names[kernel], n_threads);
+            if (mode == SERVER) {
+                printf("servers: %d, chunks in flight per checker: %d\n", n_servers, depth);
+            }
+            printf("kernel samples/s per core: scalar %.6g, batch %.6g, %s counts\n", kernel_rates[SCALAR],
+                   kernel_rates[BATCH], kernels_agree ? "same" : "DIFFERENT");
+            if (schedule != LOCKSTEP) {
+                printf("%s schedule: %" PRId64 " blocks, %" PRId64 " to %" PRId64 " per checker, %" PRId64
+                       " stolen, odd ranks %d times slower\n",
+                       schedule_names[schedule], n_blocks, blocks_min, blocks_max, n_stolen, imbalance);
+            }
+            printf("stopped on %s\n", stop_reason_names[done]);
+            printf("pi = %23.20f, error: %.3e\n", Pi, error);
+            printf("points: %" PRId64 "\nin: %" PRId64 ", out: %" PRId64 "\n", n_points, totalin, totalout);
+            printf("drawn: %" PRId64 ", time: %.6f s, %.6g samples/s, %.6g samples/s per checker\n", n_drawn,
+                   elapsed, samples_per_second, samples_per_second / n_checkers);
+            printf("%.6g samples/s per core\n", samples_per_core);
+            printf("time per checker, avg/max:");
+            for (int p = 0; p < N_CHECKER_PHASES; p++) {
+                printf(" %s %.6f/%.6f s", checker_phase_names[p], phase_sums[p] / n_checkers, phase_maxima[p]);
+            }
+            printf("\n");
+        }
+    }
+
+    MPI_Finalize();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each rank owns a tile of n_rows x n_columns cells of the global
+ * grid.  The tile is stored on the heap with one ghost row above and
+ * below and one ghost column left and right, ie as
+ * (n_rows+2) x (n_columns+2) values in row-major order. */
+#define INDEX(i, j, n_columns) ((size_t)(i) * (size_t)((n_columns) + 2) + (size_t)(j))
+
+void compute_row(int row_index, int first_column, int last_column, int n_columns,
+                 const double *input, double *output)
+{
+    const size_t stride = (size_t)n_columns + 2;
+    for (int j = first_column; j <= last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil. It is scaled by 1/5 so that the
+         * total heat on the periodic domain is conserved, which keeps
+         * long runs finite and gives us something to check. */
+        const size_t center = INDEX(row_index, j, n_columns);
+        output[center] = 0.2 * (input[center] +
+                                input[center - 1] +
+                                input[center + 1] +
+                                input[center - stride] +
+                                input[center + stride]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment */
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* Read the global grid size and number of steps. For weak
+     * scaling, grow the grid together with the number of ranks. With
+     * --copy-back, the output of each step is copied back into the
+     * input array instead of swapping the two, so the cost of that
+     * extra pass over memory can be measured. With --manual-pack, the
+     * column halos are copied through contiguous buffers instead of
+     * being described by a derived datatype. */
+    int n_global_rows = 64, n_global_columns = 64, max_step = 100;
+    int copy_back = 0, manual_pack = 0, n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--copy-back") == 0)
+        {
+            copy_back = 1;
+        }
+        else if (strcmp(argv[k], "--manual-pack") == 0)
+        {
+            manual_pack = 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments != 0 && n_arguments != 3)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--copy-back] [--manual-pack]\n", argv[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        n_global_columns = arguments[1];
+        max_step = arguments[2];
+    }
+
+    /* Arrange the ranks in a periodic 2D Cartesian grid, and find
+     * the neighbours in each direction */
+    int dims[2] = {0, 0}, periods[2] = {1, 1}, coords[2];
+    MPI_Dims_create(size, 2, dims);
+    MPI_Comm comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &comm);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Cart_coords(comm, rank, 2, coords);
+    int up_rank, down_rank, left_rank, right_rank;
+    MPI_Cart_shift(comm, 0, 1, &up_rank, &down_rank);
+    MPI_Cart_shift(comm, 1, 1, &left_rank, &right_rank);
+
+    if (n_global_rows < dims[0] || n_global_columns < dims[1] || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "A %d x %d grid can't be split over %d x %d ranks\n",
+                    n_global_rows, n_global_columns, dims[0], dims[1]);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    int n_rows, n_columns, row_offset, column_offset;
+    decompose(n_global_rows, dims[0], coords[0], &n_rows, &row_offset);
+    decompose(n_global_columns, dims[1], coords[1], &n_columns, &column_offset);
+
+    /* Prepare the initial values for this process. They depend only
+     * on the global position of each cell, so that every
+     * decomposition computes the same answer. */
+    const size_t n_values = (size_t)(n_rows + 2) * (size_t)(n_columns + 2);
+    double *working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    double local_total = 0;
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const int global_i = row_offset + i - 1;
+            const int global_j = column_offset + j - 1;
+            working_data_set[INDEX(i, j, n_columns)] = (double)((global_i + 2 * global_j) % 7);
+            local_total += working_data_set[INDEX(i, j, n_columns)];
+        }
+    }
+    double initial_total;
+    MPI_Allreduce(&local_total, &initial_total, 1, MPI_DOUBLE, MPI_SUM, comm);
+
+    /* Columns are not contiguous in memory. A vector datatype picks
+     * one value from each of the n_rows rows of a tile, so a column can
+     * be sent from, or received into, its place in the tile. It is
+     * relative to the first value of the column, so it serves both
+     * arrays and every column. */
+    MPI_Datatype column_type;
+    MPI_Type_vector(n_rows, 1, n_columns + 2, MPI_DOUBLE, &column_type);
+    MPI_Type_commit(&column_type);
+
+    /* Otherwise the columns are packed into and unpacked from these
+     * buffers */
+    double *send_left = (double *)(malloc(sizeof(double) * n_rows));
+    double *send_right = (double *)(malloc(sizeof(double) * n_rows));
+    double *recv_left = (double *)(malloc(sizeof(double) * n_rows));
+    double *recv_right = (double *)(malloc(sizeof(double) * n_rows));
+
+    /* Do the loop over heat-propagation steps */
+    const int send_up_tag = 0, send_down_tag = 1, send_left_tag = 2, send_right_tag = 3;
+    double local_copy_time = 0;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        /* Prepare to receive the halo data */
+        MPI_Request requests[8];
+        MPI_Irecv(&working_data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Irecv(&working_data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_down_tag, comm, &requests[1]);
+        if (manual_pack)
+        {
+            MPI_Irecv(recv_right, n_rows, MPI_DOUBLE, right_rank, send_left_tag, comm, &requests[2]);
+            MPI_Irecv(recv_left, n_rows, MPI_DOUBLE, left_rank, send_right_tag, comm, &requests[3]);
+        }
+        else
+        {
+            MPI_Irecv(&working_data_set[INDEX(1, n_columns + 1, n_columns)], 1, column_type,
+                      right_rank, send_left_tag, comm, &requests[2]);
+            MPI_Irecv(&working_data_set[INDEX(1, 0, n_columns)], 1, column_type,
+                      left_rank, send_right_tag, comm, &requests[3]);
+        }
+
+        /* Prepare to send the border data */
+        MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_up_tag, comm, &requests[4]);
+        MPI_Isend(&working_data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_down_tag, comm, &requests[5]);
+        if (manual_pack)
+        {
+            for (int i = 1; i <= n_rows; i = i + 1)
+            {
+                send_left[i - 1] = working_data_set[INDEX(i, 1, n_columns)];
+                send_right[i - 1] = working_data_set[INDEX(i, n_columns, n_columns)];
+            }
+            MPI_Isend(send_left, n_rows, MPI_DOUBLE, left_rank, send_left_tag, comm, &requests[6]);
+            MPI_Isend(send_right, n_rows, MPI_DOUBLE, right_rank, send_right_tag, comm, &requests[7]);
+        }
+        else
+        {
+            MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], 1, column_type,
+                      left_rank, send_left_tag, comm, &requests[6]);
+            MPI_Isend(&working_data_set[INDEX(1, n_columns, n_columns)], 1, column_type,
+                      right_rank, send_right_tag, comm, &requests[7]);
+        }
+
+        /* Do the local computation, which needs no halo data */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 2, n_columns - 1, n_columns, working_data_set, next_working_data_set);
+        }
+
+        /* Wait for the halo-exchange receives to complete */
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+        if (manual_pack)
+        {
+            for (int i = 1; i <= n_rows; i = i + 1)
+            {
+                working_data_set[INDEX(i, 0, n_columns)] = recv_left[i - 1];
+                working_data_set[INDEX(i, n_columns + 1, n_columns)] = recv_right[i - 1];
+            }
+        }
+
+        /* Do the non-local computation on the border of the tile */
+        compute_row(1, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        }
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 1, 1, n_columns, working_data_set, next_working_data_set);
+            if (n_columns > 1)
+            {
+                compute_row(i, n_columns, n_columns, n_columns, working_data_set, next_working_data_set);
+            }
+        }
+
+        /* Wait for the halo-exchange sends to complete */
+        MPI_Waitall(4, &requests[4], MPI_STATUSES_IGNORE);
+
+        /* Prepare to iterate */
+        if (copy_back)
+        {
+            const double copy_start_time = MPI_Wtime();
+            for (int i = 1; i <= n_rows; i = i + 1)
+            {
+                for (int j = 1; j <= n_columns; j = j + 1)
+                {
+                    /* copy the output back to the input array */
+                    working_data_set[INDEX(i, j, n_columns)] = next_working_data_set[INDEX(i, j, n_columns)];
+                }
+            }
+            local_copy_time += MPI_Wtime() - copy_start_time;
+        }
+        else
+        {
+            /* swap the input and output arrays, so that the halo
+             * receives of the next step target the new input */
+            double *temporary = working_data_set;
+            working_data_set = next_working_data_set;
+            next_working_data_set = temporary;
+        }
+    }
+    const double local_elapsed = MPI_Wtime() - start_time;
+
+    /* Report whether the code is correct, ie. whether the total heat
+     * was conserved, and how fast it was */
+    double local_sums[2] = {0, 0}, sums[2];
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const double value = working_data_set[INDEX(i, j, n_columns)];
+            local_sums[0] += value;
+            local_sums[1] += value * value;
+        }
+    }
+    double elapsed, copy_time;
+    MPI_Reduce(local_sums, sums, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+    const double total = sums[0];
+    MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(&local_copy_time, &copy_time, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d x %d ranks, %d steps, column halos %s\n",
+               n_global_rows, n_global_columns, dims[0], dims[1], max_step,
+               manual_pack ? "packed manually" : "sent with a vector datatype");
+        printf("Sum of squares (compare across decompositions): %.12g\n", sums[1]);
+        printf("Time per step: %g s, cell updates per second: %g\n",
+               (max_step > 0) ? elapsed / max_step : 0.0,
+               (elapsed > 0) ? (double)n_global_rows * n_global_columns * max_step / elapsed : 0.0);
+        if (copy_back)
+        {
+            /* Each copy reads and writes every owned cell once, which is
+             * the memory traffic that swapping the arrays saves */
+            const double bytes_copied = 2.0 * sizeof(double) * n_global_rows * n_global_columns * max_step;
+            printf("Copy-back took %.1f%% of the time, moving %g bytes at %g bytes per second per rank\n",
+                   (elapsed > 0) ? 100.0 * copy_time / elapsed : 0.0, bytes_copied,
+                   (copy_time > 0) ? bytes_copied / copy_time / size : 0.0);
+        }
+        if (fabs(total - initial_total) <= 1e-9 * fabs(initial_total))
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success! "
+                   "Total %.17g does not match initial total %.17g\n",
+                   rank, total, initial_total);
+        }
+    }
+
+    /* Clean up and exit */
+    free(working_data_set);
+    free(next_working_data_set);
+    free(send_left);
+    free(send_right);
+    free(recv_left);
+    free(recv_right);
+    MPI_Type_free(&column_type);
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    return 0;
+}
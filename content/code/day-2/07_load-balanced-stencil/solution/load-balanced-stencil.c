@@ -0,0 +1,414 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each rank owns a band of full-width rows of the grid, stored with
+ * one ghost row above and below. The columns are periodic. The bands
+ * are given by offsets: rank r owns global rows offsets[r] up to, but
+ * not including, offsets[r + 1]. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    /* Here is the 5-point stencil, scaled by 1/5 so that the total heat
+     * is conserved. The periodic wrap-around columns are peeled out of
+     * the loop over the other columns. */
+    output_row[0] = 0.2 * (this_row[0] + this_row[width - 1] + this_row[1 % width] +
+                           top_row[0] + bottom_row[0]);
+    for (int j = 1; j < width - 1; j = j + 1)
+    {
+        output_row[j] = 0.2 * (this_row[j] + this_row[j - 1] + this_row[j + 1] +
+                               top_row[j] + bottom_row[j]);
+    }
+    if (width > 1)
+    {
+        output_row[width - 1] = 0.2 * (this_row[width - 1] + this_row[width - 2] + this_row[0] +
+                                       top_row[width - 1] + bottom_row[width - 1]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Choose new bands so that each rank gets rows in proportion to the
+ * rate at which it computed them. Only the boundaries between bands
+ * move, and each by at most max_move rows, so that rows only ever
+ * move between neighbours. Each boundary also moves by less than half
+ * of the band it takes rows from, so that every rank keeps at least
+ * one row, even when it gives rows away at both ends. */
+void balance_rows(int size, const int *offsets, const double *compute_times, int max_move, int *new_offsets)
+{
+    double *rates = (double *)(malloc(sizeof(double) * size));
+    double total_rate = 0;
+    for (int r = 0; r < size; r = r + 1)
+    {
+        const double time = (compute_times[r] > 1e-9) ? compute_times[r] : 1e-9;
+        rates[r] = (offsets[r + 1] - offsets[r]) / time;
+        total_rate += rates[r];
+    }
+    const int n_global_rows = offsets[size];
+    new_offsets[0] = 0;
+    new_offsets[size] = n_global_rows;
+    double rate_above = 0;
+    for (int b = 1; b < size; b = b + 1)
+    {
+        rate_above += rates[b - 1];
+        int target = (int)(lround(n_global_rows * rate_above / total_rate));
+        const int max_up = (offsets[b] - offsets[b - 1] - 1) / 2;
+        const int max_down = (offsets[b + 1] - offsets[b] - 1) / 2;
+        const int lowest = offsets[b] - ((max_up < max_move) ? max_up : max_move);
+        const int highest = offsets[b] + ((max_down < max_move) ? max_down : max_move);
+        target = (target < lowest) ? lowest : target;
+        target = (target > highest) ? highest : target;
+        new_offsets[b] = target;
+    }
+    free(rates);
+}
+
+/* Move rows between neighbours so that this rank owns the band given
+ * by new_offsets instead of the one given by offsets. Rows moving down
+ * to the next rank use one tag, and rows moving up use the other. The
+ * data set is replaced with one of the new size. */
+void migrate_rows(double **data_set, int width, const int *offsets, const int *new_offsets, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const int old_first = offsets[rank], old_end = offsets[rank + 1];
+    const int new_first = new_offsets[rank], new_end = new_offsets[rank + 1];
+    const int moving_down_tag = 0, moving_up_tag = 1;
+    double *old_data_set = *data_set;
+    double *new_data_set = (double *)(calloc((size_t)(new_end - new_first + 2) * width, sizeof(double)));
+
+    /* Keep the rows that stay here */
+    const int first_kept = (old_first > new_first) ? old_first : new_first;
+    const int end_kept = (old_end < new_end) ? old_end : new_end;
+    for (int g = first_kept; g < end_kept; g = g + 1)
+    {
+        memcpy(row(new_data_set, g - new_first + 1, width), row(old_data_set, g - old_first + 1, width),
+               sizeof(double) * width);
+    }
+
+    /* Take rows from, or give rows to, the neighbours */
+    MPI_Request requests[2];
+    int n_requests = 0;
+    if (new_first < old_first)
+    {
+        MPI_Irecv(row(new_data_set, 1, width), (old_first - new_first) * width, MPI_DOUBLE,
+                  rank - 1, moving_down_tag, comm, &requests[n_requests++]);
+    }
+    else if (new_first > old_first)
+    {
+        MPI_Isend(row(old_data_set, 1, width), (new_first - old_first) * width, MPI_DOUBLE,
+                  rank - 1, moving_up_tag, comm, &requests[n_requests++]);
+    }
+    if (new_end > old_end)
+    {
+        MPI_Irecv(row(new_data_set, old_end - new_first + 1, width), (new_end - old_end) * width, MPI_DOUBLE,
+                  rank + 1, moving_up_tag, comm, &requests[n_requests++]);
+    }
+    else if (new_end < old_end)
+    {
+        MPI_Isend(row(old_data_set, new_end - old_first + 1, width), (old_end - new_end) * width, MPI_DOUBLE,
+                  rank + 1, moving_down_tag, comm, &requests[n_requests++]);
+    }
+    MPI_Waitall(n_requests, requests, MPI_STATUSES_IGNORE);
+    free(old_data_set);
+    *data_set = new_data_set;
+}
+
+/* The settings of a run. Every rebalance_interval steps, the ranks
+ * gather their compute times, and when the load imbalance is above
+ * min_imbalance, move rows towards the faster ranks. An imbalance is
+ * never above 1, so with min_imbalance 1 the bands stay fixed and are
+ * only measured. To emulate ranks that share their cores with other
+ * jobs, the odd-numbered ranks do every update slowdown times over. */
+struct balance_settings
+{
+    int rebalance_interval;
+    int max_move;
+    double min_imbalance;
+    int slowdown;
+    int verbose;
+};
+
+/* Run max_step steps on the ring of ranks. Returns the time taken, the
+ * load imbalance of the computation over the last steps, and on rank 0
+ * the whole final grid, which the caller must free. */
+double run_steps(const struct balance_settings *settings, int max_step, int n_global_rows, int width,
+                 MPI_Comm comm, double *last_imbalance, double **final_grid)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    const int n_repeats = (rank % 2 == 1) ? settings->slowdown : 1;
+
+    /* Start from bands that are as even as possible. Every rank keeps
+     * a copy of all the offsets. */
+    int *offsets = (int *)(malloc(sizeof(int) * (size + 1)));
+    int *new_offsets = (int *)(malloc(sizeof(int) * (size + 1)));
+    for (int r = 0; r < size; r = r + 1)
+    {
+        int n_local;
+        decompose(n_global_rows, size, r, &n_local, &offsets[r]);
+    }
+    offsets[size] = n_global_rows;
+    double *compute_times = (double *)(malloc(sizeof(double) * size));
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    int n_rows = offsets[rank + 1] - offsets[rank];
+    double *working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(working_data_set, i, width)[j] = (double)((offsets[rank] + i - 1 + 2 * j) % 7);
+        }
+    }
+
+    const int send_up_tag = 0, send_down_tag = 1;
+    double compute_time = 0;
+    *last_imbalance = 0;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        /* Exchange the halos */
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation, timing only the computation */
+        double compute_start_time = MPI_Wtime();
+        for (int repeat = 0; repeat < n_repeats; repeat = repeat + 1)
+        {
+            for (int i = 2; i < n_rows; i = i + 1)
+            {
+                compute_row(i, width, working_data_set, next_working_data_set);
+            }
+        }
+        compute_time += MPI_Wtime() - compute_start_time;
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation */
+        compute_start_time = MPI_Wtime();
+        for (int repeat = 0; repeat < n_repeats; repeat = repeat + 1)
+        {
+            compute_row(1, width, working_data_set, next_working_data_set);
+            if (n_rows > 1)
+            {
+                compute_row(n_rows, width, working_data_set, next_working_data_set);
+            }
+        }
+        compute_time += MPI_Wtime() - compute_start_time;
+
+        /* Prepare to iterate by swapping the buffers */
+        double *temporary_data_set = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary_data_set;
+
+        if ((step + 1) % settings->rebalance_interval == 0)
+        {
+            /* Measure the load imbalance of the computation, as in the
+             * scatter-and-gather exercise */
+            MPI_Gather(&compute_time, 1, MPI_DOUBLE, compute_times, 1, MPI_DOUBLE, 0, comm);
+            compute_time = 0;
+            if (rank == 0)
+            {
+                double time_sum = 0.0, max_time = 0.0;
+                for (int r = 0; r < size; r = r + 1)
+                {
+                    time_sum += compute_times[r];
+                    max_time = (compute_times[r] > max_time) ? compute_times[r] : max_time;
+                }
+                *last_imbalance = (max_time > 0) ? 1.0 - (time_sum / size) / max_time : 0.0;
+
+                /* Only move rows when it is worth it */
+                if (*last_imbalance > settings->min_imbalance)
+                {
+                    balance_rows(size, offsets, compute_times, settings->max_move, new_offsets);
+                }
+                else
+                {
+                    memcpy(new_offsets, offsets, sizeof(int) * (size + 1));
+                }
+                if (settings->verbose)
+                {
+                    printf("  step %6d: load imbalance %5.1f%%, rows per rank", step + 1, *last_imbalance * 100.0);
+                    for (int r = 0; r < size && r < 16; r = r + 1)
+                    {
+                        printf(" %d", new_offsets[r + 1] - new_offsets[r]);
+                    }
+                    printf("%s\n", (size > 16) ? " ..." : "");
+                }
+            }
+            MPI_Bcast(new_offsets, size + 1, MPI_INT, 0, comm);
+
+            /* Move the rows, and make the other buffer fit */
+            migrate_rows(&working_data_set, width, offsets, new_offsets, comm);
+            int *temporary_offsets = offsets;
+            offsets = new_offsets;
+            new_offsets = temporary_offsets;
+            n_rows = offsets[rank + 1] - offsets[rank];
+            free(next_working_data_set);
+            next_working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+        }
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+
+    /* Gather the bands of the final grid, which are now of different
+     * sizes. The grid doesn't depend on how the rows were spread, so it
+     * can be compared with that of a run without rebalancing. */
+    int *counts = (int *)(malloc(sizeof(int) * size));
+    int *displacements = (int *)(malloc(sizeof(int) * size));
+    for (int r = 0; r < size; r = r + 1)
+    {
+        counts[r] = (offsets[r + 1] - offsets[r]) * width;
+        displacements[r] = offsets[r] * width;
+    }
+    *final_grid = NULL;
+    if (rank == 0)
+    {
+        *final_grid = (double *)(malloc(sizeof(double) * n_global_rows * width));
+    }
+    MPI_Gatherv(row(working_data_set, 1, width), n_rows * width, MPI_DOUBLE, *final_grid, counts,
+                displacements, MPI_DOUBLE, 0, comm);
+    free(counts);
+    free(displacements);
+
+    free(offsets);
+    free(new_offsets);
+    free(compute_times);
+    free(working_data_set);
+    free(next_working_data_set);
+
+    double max_elapsed;
+    MPI_Allreduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, comm);
+    return max_elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Read the global grid size, the number of steps, how often to
+     * rebalance, and how much slower the odd-numbered ranks are */
+    int n_global_rows = 1024, width = 512, max_step = 1000;
+    struct balance_settings settings = {100, 64, 0.02, 3, 1};
+    int n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--interval") == 0 && k + 1 < argc)
+        {
+            settings.rebalance_interval = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--imbalance") == 0 && k + 1 < argc)
+        {
+            settings.slowdown = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        width = arguments[1];
+        max_step = arguments[2];
+    }
+    if ((n_arguments != 0 && n_arguments != 3) || n_global_rows < size || width < 1 || max_step < 0 ||
+        settings.rebalance_interval < 1 || settings.slowdown < 1)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--interval N] [--imbalance F]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d ranks, %d steps, odd-numbered ranks %d times slower\n",
+               n_global_rows, width, size, max_step, settings.slowdown);
+        printf("Rebalancing every %d steps:\n", settings.rebalance_interval);
+    }
+    double balanced_imbalance, *balanced_grid;
+    const double balanced_time = run_steps(&settings, max_step, n_global_rows, width, comm,
+                                           &balanced_imbalance, &balanced_grid);
+
+    /* Measure the imbalance of fixed bands over the whole run, once at
+     * the end */
+    struct balance_settings static_settings = settings;
+    static_settings.rebalance_interval = max_step;
+    static_settings.min_imbalance = 1.0;
+    static_settings.verbose = 0;
+    double static_imbalance, *static_grid;
+    const double static_time = run_steps(&static_settings, max_step, n_global_rows, width, comm,
+                                         &static_imbalance, &static_grid);
+
+    if (rank == 0)
+    {
+        printf("%12s %16s %16s\n", "bands", "time/step (s)", "load imbalance");
+        printf("%12s %16.6g %15.1f%%\n", "fixed", (max_step > 0) ? static_time / max_step : 0.0,
+               static_imbalance * 100.0);
+        printf("%12s %16.6g %15.1f%%\n", "rebalanced", (max_step > 0) ? balanced_time / max_step : 0.0,
+               balanced_imbalance * 100.0);
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (memcmp(balanced_grid, static_grid, sizeof(double) * n_global_rows * width) == 0)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(balanced_grid);
+    free(static_grid);
+    MPI_Finalize();
+    return 0;
+}
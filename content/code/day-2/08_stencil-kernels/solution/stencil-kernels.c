@@ -0,0 +1,324 @@
+#include "mpi.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The stencil and the type of the grid values are chosen when
+ * compiling, eg
+ *
+ *   mpicc -O2 -DSTENCIL=NINE_POINT -DELEMENT_TYPE=float stencil-kernels.c
+ *
+ * so that each combination gets a kernel whose loop body is fully
+ * unrolled over the taps, with the weights as constants. */
+#ifndef STENCIL
+#define STENCIL FIVE_POINT
+#endif
+#ifndef ELEMENT_TYPE
+#define ELEMENT_TYPE double
+#endif
+typedef ELEMENT_TYPE element_t;
+
+/* Each stencil is a list of taps, given as TAP(row offset, column
+ * offset, weight), and the radius, ie the largest offset of any tap.
+ * The new value of a cell is the weighted sum over the taps divided by
+ * the sum of the weights, so the total heat is conserved, except for
+ * rounding, and for truncation with integer values. */
+
+/* The classic 5-point stencil, u + L5(u) / 5 */
+#define FIVE_POINT_TAPS(TAP) \
+    TAP(0, 0, 1)             \
+    TAP(0, -1, 1)            \
+    TAP(0, 1, 1)             \
+    TAP(-1, 0, 1)            \
+    TAP(1, 0, 1)
+#define FIVE_POINT_RADIUS 1
+#define FIVE_POINT_DIVISOR 5
+
+/* The isotropic 9-point stencil, u + L9(u) / 6, which also needs the
+ * diagonal neighbours */
+#define NINE_POINT_TAPS(TAP) \
+    TAP(0, 0, 16)            \
+    TAP(0, -1, 4)            \
+    TAP(0, 1, 4)             \
+    TAP(-1, 0, 4)            \
+    TAP(1, 0, 4)             \
+    TAP(-1, -1, 1)           \
+    TAP(-1, 1, 1)            \
+    TAP(1, -1, 1)            \
+    TAP(1, 1, 1)
+#define NINE_POINT_RADIUS 1
+#define NINE_POINT_DIVISOR 36
+
+/* The fourth-order accurate 9-point star, u + L4(u) / 10, which reaches
+ * two cells in each direction */
+#define FOURTH_ORDER_TAPS(TAP) \
+    TAP(0, 0, 60)              \
+    TAP(0, -1, 16)             \
+    TAP(0, 1, 16)              \
+    TAP(-1, 0, 16)             \
+    TAP(1, 0, 16)              \
+    TAP(0, -2, -1)             \
+    TAP(0, 2, -1)              \
+    TAP(-2, 0, -1)             \
+    TAP(2, 0, -1)
+#define FOURTH_ORDER_RADIUS 2
+#define FOURTH_ORDER_DIVISOR 120
+
+/* Pick the taps, radius and divisor of the chosen stencil */
+#define PASTE(a, b) a##b
+#define EXPAND_PASTE(a, b) PASTE(a, b)
+#define STRINGIFY(a) #a
+#define EXPAND_STRINGIFY(a) STRINGIFY(a)
+#define STENCIL_TAPS EXPAND_PASTE(STENCIL, _TAPS)
+#define RADIUS EXPAND_PASTE(STENCIL, _RADIUS)
+#define DIVISOR EXPAND_PASTE(STENCIL, _DIVISOR)
+
+#define ADD_TAP(row_offset, column_offset, weight) \
+    +(element_t)(weight) * input[center + (row_offset) * stride + (column_offset)]
+#define COUNT_TAP(row_offset, column_offset, weight) +1
+#define SUM_WEIGHT(row_offset, column_offset, weight) +(weight)
+#define SUM_ABS_WEIGHT(row_offset, column_offset, weight) +((weight) < 0 ? -(weight) : (weight))
+#define N_TAPS (0 STENCIL_TAPS(COUNT_TAP))
+_Static_assert((0 STENCIL_TAPS(SUM_WEIGHT)) == DIVISOR, "the weights of the stencil must sum to its divisor");
+
+/* Integers are divided, floating-point values are multiplied by the
+ * reciprocal, which the compiler may not do by itself */
+#define NORMALIZE(sum) _Generic((sum), int: (sum) / DIVISOR, default: (sum) * ((element_t)1 / DIVISOR))
+
+/* The MPI datatype and a name matching element_t */
+#define MPI_ELEMENT_T _Generic((element_t)0, int: MPI_INT, float: MPI_FLOAT, double: MPI_DOUBLE)
+#define ELEMENT_T_NAME _Generic((element_t)0, int: "int", float: "float", double: "double")
+
+/* Integer division truncates every update, which with a large divisor
+ * soon wipes out a grid of small values. So integer grids start with
+ * values scaled up as far as the weighted sums still fit in an int, and
+ * the heat is reported in the unscaled units. */
+#define INITIAL_SCALE _Generic((element_t)0, int: 1 << 20, default: 1)
+#define MAX_INITIAL_VALUE 6
+_Static_assert((long long)MAX_INITIAL_VALUE * INITIAL_SCALE * (0 STENCIL_TAPS(SUM_ABS_WEIGHT)) <= INT_MAX,
+               "the scaled weighted sums of the stencil must fit in an int");
+
+/* Each rank owns n_rows full-width rows of the grid. A row is stored
+ * with RADIUS ghost columns at each end, which hold copies of the
+ * columns at the other end, as the columns are periodic. Above and
+ * below are RADIUS ghost rows, filled from the neighbouring ranks. */
+element_t *row(element_t *data_set, int row_index, int stride)
+{
+    return data_set + (size_t)row_index * stride;
+}
+
+void compute_row(int row_index, int width, const element_t *input, element_t *output)
+{
+    const int stride = width + 2 * RADIUS;
+    for (int j = RADIUS; j < RADIUS + width; j = j + 1)
+    {
+        const size_t center = (size_t)row_index * stride + j;
+        output[center] = NORMALIZE(STENCIL_TAPS(ADD_TAP));
+    }
+}
+
+/* Copy each end of the owned part of a row into the ghost columns at
+ * the other end */
+void fill_ghost_columns(element_t *row_data, int width)
+{
+    for (int k = 0; k < RADIUS; k = k + 1)
+    {
+        row_data[k] = row_data[width + k];
+        row_data[RADIUS + width + k] = row_data[RADIUS + k];
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Run max_step steps on the ranks of comm, and return the owned rows
+ * of this rank, including their ghost columns, and the time taken. The
+ * halo exchange sends RADIUS whole rows, ghost columns included, so the
+ * corners needed by diagonal taps come along without any extra
+ * messages. */
+element_t *run_steps(int max_step, int n_global_rows, int width, MPI_Comm comm, double *elapsed)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    const int stride = width + 2 * RADIUS;
+    const size_t n_values = (size_t)(n_rows + 2 * RADIUS) * stride;
+    element_t *working_data_set = (element_t *)(calloc(n_values, sizeof(element_t)));
+    element_t *next_working_data_set = (element_t *)(calloc(n_values, sizeof(element_t)));
+    for (int i = 0; i < n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(working_data_set, RADIUS + i, stride)[RADIUS + j] = (element_t)((row_offset + i + 2 * j) % (MAX_INITIAL_VALUE + 1) * INITIAL_SCALE);
+        }
+    }
+
+    /* The rows that don't read any ghost row can be computed while the
+     * halos are in flight */
+    const int first_owned_row = RADIUS, last_owned_row = RADIUS + n_rows - 1;
+    const int first_inner_row = 2 * RADIUS, last_inner_row = n_rows - 1;
+    const int halo_size = RADIUS * stride;
+    const int send_up_tag = 0, send_down_tag = 1;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        for (int i = first_owned_row; i <= last_owned_row; i = i + 1)
+        {
+            fill_ghost_columns(row(working_data_set, i, stride), width);
+        }
+
+        /* Exchange the halos */
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, last_owned_row + 1, stride), halo_size, MPI_ELEMENT_T, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, stride), halo_size, MPI_ELEMENT_T, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, first_owned_row, stride), halo_size, MPI_ELEMENT_T, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, last_owned_row - RADIUS + 1, stride), halo_size, MPI_ELEMENT_T,
+                  down_rank, send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation */
+        for (int i = first_inner_row; i <= last_inner_row; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation */
+        for (int i = first_owned_row; i <= last_owned_row; i = i + 1)
+        {
+            if (i < first_inner_row || i > last_inner_row)
+            {
+                compute_row(i, width, working_data_set, next_working_data_set);
+            }
+        }
+
+        /* Prepare to iterate by swapping the buffers */
+        element_t *temporary_data_set = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary_data_set;
+    }
+    *elapsed = MPI_Wtime() - start_time;
+
+    /* Return just the owned rows */
+    memmove(working_data_set, row(working_data_set, first_owned_row, stride),
+            sizeof(element_t) * n_rows * stride);
+    free(next_working_data_set);
+    return working_data_set;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Read the global grid size and the number of steps */
+    int n_global_rows = 1024, width = 1024, max_step = 50;
+    if (argc == 4)
+    {
+        n_global_rows = atoi(argv[1]);
+        width = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+    }
+    /* Each rank needs at least RADIUS rows, so that its halos come
+     * only from its immediate neighbours */
+    if ((argc != 1 && argc != 4) || n_global_rows < size * RADIUS || width < RADIUS || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps], with at least %d rows per rank and %d columns\n",
+                    argv[0], RADIUS, RADIUS);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* Run on all ranks */
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+    const int stride = width + 2 * RADIUS;
+    double local_elapsed, elapsed;
+    element_t *local_result = run_steps(max_step, n_global_rows, width, comm, &local_elapsed);
+    MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+    /* Collect the grid on rank 0, and compare it with the same steps
+     * run on rank 0 alone, which must agree bitwise since every cell is
+     * computed by the same sequence of operations */
+    int *counts = (int *)(malloc(sizeof(int) * size));
+    int *displacements = (int *)(malloc(sizeof(int) * size));
+    for (int r = 0; r < size; r = r + 1)
+    {
+        int n_part_rows, part_row_offset;
+        decompose(n_global_rows, size, r, &n_part_rows, &part_row_offset);
+        counts[r] = n_part_rows * stride;
+        displacements[r] = part_row_offset * stride;
+    }
+    element_t *result = NULL;
+    if (rank == 0)
+    {
+        result = (element_t *)(malloc(sizeof(element_t) * n_global_rows * stride));
+    }
+    MPI_Gatherv(local_result, n_rows * stride, MPI_ELEMENT_T, result, counts, displacements, MPI_ELEMENT_T, 0,
+                comm);
+    if (rank == 0)
+    {
+        double serial_elapsed;
+        element_t *reference = run_steps(max_step, n_global_rows, width, MPI_COMM_SELF, &serial_elapsed);
+        int success = 1;
+        double total = 0;
+        for (int i = 0; i < n_global_rows; i = i + 1)
+        {
+            const element_t *result_row = row(result, i, stride) + RADIUS;
+            const element_t *reference_row = row(reference, i, stride) + RADIUS;
+            success = success && (memcmp(result_row, reference_row, sizeof(element_t) * width) == 0);
+            for (int j = 0; j < width; j = j + 1)
+            {
+                total += (double)result_row[j] / INITIAL_SCALE;
+            }
+        }
+        printf("%s stencil of radius %d with %d taps on %s values\n", EXPAND_STRINGIFY(STENCIL), RADIUS, N_TAPS,
+               ELEMENT_T_NAME);
+        printf("Grid of %d x %d cells on %d ranks, %d steps, total heat %.10g\n", n_global_rows, width, size,
+               max_step, total);
+        printf("%d ranks: %g s, %g cell updates per second, 1 rank: %g s\n", size, elapsed,
+               (elapsed > 0) ? (double)n_global_rows * width * max_step / elapsed : 0.0, serial_elapsed);
+
+        /* Report whether the code is correct */
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+        free(reference);
+        free(result);
+    }
+
+    /* Clean up and exit */
+    free(counts);
+    free(displacements);
+    free(local_result);
+    MPI_Finalize();
+    return 0;
+}
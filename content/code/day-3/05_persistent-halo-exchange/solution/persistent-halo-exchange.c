@@ -0,0 +1,299 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Partitioned point-to-point communication arrived in MPI 4.0, so
+ * only use it when the library provides it */
+#if MPI_VERSION >= 4
+#define HAVE_PARTITIONED 1
+#else
+#define HAVE_PARTITIONED 0
+#endif
+
+/* The halo exchange can either re-post the messages on every step, or
+ * set them up once as persistent (or partitioned) requests and then
+ * only start them on every step. */
+enum halo_mode
+{
+    REPOSTED = 0,
+    PERSISTENT = 1,
+    PARTITIONED = 2
+};
+const char *halo_mode_names[] = {"re-posted", "persistent", "partitioned"};
+const int n_partitions = 4;
+
+/* Each rank owns 4 rows of width values, stored with one ghost row
+ * above and below, ie. rows 0 and 5 receive the halo data. */
+float *row(float *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, float *input, float *output)
+{
+    const float *top_row = row(input, row_index - 1, width);
+    const float *this_row = row(input, row_index, width);
+    const float *bottom_row = row(input, row_index + 1, width);
+    float *output_row = row(output, row_index, width);
+    for (int j = 0; j < width; j = j + 1)
+    {
+        /* Here is the 5-point stencil */
+        const int right_column_index = (j == width - 1) ? 0 : j + 1;
+        const int left_column_index = (j == 0) ? width - 1 : j - 1;
+        output_row[j] = (this_row[j] +
+                         this_row[left_column_index] +
+                         this_row[right_column_index] +
+                         top_row[j] +
+                         bottom_row[j]);
+    }
+}
+
+/* Create the requests for the halo exchange, ie. receives into rows 5
+ * and 0 followed by sends from rows 1 and 4. Re-posted requests are
+ * instead created by start_halo_exchange() on every step. */
+void init_halo_exchange(enum halo_mode mode, float *data_set, int width,
+                        int up_rank, int down_rank, MPI_Comm comm,
+                        MPI_Request requests[4])
+{
+    const int send_up_tag = 0, send_down_tag = 1;
+    if (mode == PERSISTENT)
+    {
+        MPI_Recv_init(row(data_set, 5, width), width, MPI_FLOAT, down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Recv_init(row(data_set, 0, width), width, MPI_FLOAT, up_rank, send_down_tag, comm, &requests[1]);
+        MPI_Send_init(row(data_set, 1, width), width, MPI_FLOAT, up_rank, send_up_tag, comm, &requests[2]);
+        MPI_Send_init(row(data_set, 4, width), width, MPI_FLOAT, down_rank, send_down_tag, comm, &requests[3]);
+    }
+#if HAVE_PARTITIONED
+    else if (mode == PARTITIONED)
+    {
+        const int count = width / n_partitions;
+        MPI_Precv_init(row(data_set, 5, width), n_partitions, count, MPI_FLOAT, down_rank, send_up_tag,
+                       comm, MPI_INFO_NULL, &requests[0]);
+        MPI_Precv_init(row(data_set, 0, width), n_partitions, count, MPI_FLOAT, up_rank, send_down_tag,
+                       comm, MPI_INFO_NULL, &requests[1]);
+        MPI_Psend_init(row(data_set, 1, width), n_partitions, count, MPI_FLOAT, up_rank, send_up_tag,
+                       comm, MPI_INFO_NULL, &requests[2]);
+        MPI_Psend_init(row(data_set, 4, width), n_partitions, count, MPI_FLOAT, down_rank, send_down_tag,
+                       comm, MPI_INFO_NULL, &requests[3]);
+    }
+#endif
+    else
+    {
+        for (int k = 0; k < 4; k = k + 1)
+        {
+            requests[k] = MPI_REQUEST_NULL;
+        }
+    }
+}
+
+void start_halo_exchange(enum halo_mode mode, float *data_set, int width,
+                         int up_rank, int down_rank, MPI_Comm comm,
+                         MPI_Request requests[4])
+{
+    if (mode == REPOSTED)
+    {
+        const int send_up_tag = 0, send_down_tag = 1;
+        MPI_Irecv(row(data_set, 5, width), width, MPI_FLOAT, down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(data_set, 0, width), width, MPI_FLOAT, up_rank, send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(data_set, 1, width), width, MPI_FLOAT, up_rank, send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(data_set, 4, width), width, MPI_FLOAT, down_rank, send_down_tag, comm, &requests[3]);
+        return;
+    }
+    MPI_Startall(4, requests);
+#if HAVE_PARTITIONED
+    if (mode == PARTITIONED)
+    {
+        /* The border rows are complete, so all partitions are ready */
+        MPI_Pready_range(0, n_partitions - 1, requests[2]);
+        MPI_Pready_range(0, n_partitions - 1, requests[3]);
+    }
+#endif
+}
+
+void free_halo_exchange(enum halo_mode mode, MPI_Request requests[4])
+{
+    if (mode == REPOSTED)
+    {
+        return;
+    }
+    for (int k = 0; k < 4; k = k + 1)
+    {
+        MPI_Request_free(&requests[k]);
+    }
+}
+
+/* Run n_steps heat-propagation steps. When iterate is true, each
+ * step reads one buffer and writes the other and then they swap
+ * roles. Persistent requests are bound to one buffer, so a set of
+ * requests is made for each and the step uses the set matching its
+ * input. When iterate is false the output is never fed back, which
+ * keeps the values bounded while measuring. Returns the time taken on
+ * this rank. */
+double run_steps(enum halo_mode mode, int n_steps, int iterate, int width,
+                 float *data_sets[2], int up_rank, int down_rank, MPI_Comm comm)
+{
+    MPI_Request requests[2][4];
+    init_halo_exchange(mode, data_sets[0], width, up_rank, down_rank, comm, requests[0]);
+    init_halo_exchange(mode, data_sets[1], width, up_rank, down_rank, comm, requests[1]);
+
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < n_steps; step = step + 1)
+    {
+        const int input = iterate ? step % 2 : 0;
+        float *working_data_set = data_sets[input];
+        float *next_working_data_set = data_sets[1 - input];
+        MPI_Request *step_requests = requests[input];
+
+        start_halo_exchange(mode, working_data_set, width, up_rank, down_rank, comm, step_requests);
+
+        /* Do the local computation */
+        compute_row(2, width, working_data_set, next_working_data_set);
+        compute_row(3, width, working_data_set, next_working_data_set);
+
+        /* Wait for the halo-exchange receives to complete */
+        MPI_Waitall(2, &step_requests[0], MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation */
+        compute_row(1, width, working_data_set, next_working_data_set);
+        compute_row(4, width, working_data_set, next_working_data_set);
+
+        /* Wait for the halo-exchange sends to complete */
+        MPI_Waitall(2, &step_requests[2], MPI_STATUSES_IGNORE);
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+
+    /* Leave the most recent output in the first buffer */
+    if (iterate && n_steps % 2 == 1)
+    {
+        float *temporary_data_set = data_sets[0];
+        data_sets[0] = data_sets[1];
+        data_sets[1] = temporary_data_set;
+    }
+
+    free_halo_exchange(mode, requests[0]);
+    free_halo_exchange(mode, requests[1]);
+    return elapsed;
+}
+
+void initialize(int rank, int width, float *working_data_set)
+{
+    for (int i = 1; i < 5; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            /* Make sure the local data on each rank is different, so
+             * that we see the communication works properly. */
+            row(working_data_set, i, width)[j] = 1*(rank + 1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring, so that
+     * any number of ranks can be used. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+
+    int n_repeats = 10000;
+    if (argc > 1)
+    {
+        n_repeats = atoi(argv[1]);
+    }
+    const int n_modes = HAVE_PARTITIONED ? 3 : 2;
+    const int widths[] = {8, 64, 512, 4096, 32768};
+    const int n_widths = sizeof(widths) / sizeof(widths[0]);
+    const int max_width = widths[n_widths - 1];
+    float *data_sets[2];
+    data_sets[0] = (float *)(calloc((size_t)6 * max_width, sizeof(float)));
+    data_sets[1] = (float *)(calloc((size_t)6 * max_width, sizeof(float)));
+
+    /* Check that every mode computes the same 10 heat-propagation
+     * steps as the original code. Each step multiplies the total heat
+     * by 5. */
+    int success = 1;
+    const int width = 8, max_step = 10;
+    for (int mode = 0; mode < n_modes; mode = mode + 1)
+    {
+        initialize(rank, width, data_sets[0]);
+        run_steps(mode, max_step, 1, width, data_sets, up_rank, down_rank, comm);
+        float local_total = 0, total;
+        for (int i = 1; i < 5; i = i + 1)
+        {
+            for (int j = 0; j < width; j = j + 1)
+            {
+                local_total += row(data_sets[0], i, width)[j];
+            }
+        }
+        MPI_Reduce(&local_total, &total, 1, MPI_FLOAT, MPI_SUM, 0, comm);
+        const float expected_total_value = pow(5, max_step) * 4 * width * size * (size + 1) / 2;
+        if (rank == 0 && fabs(total - expected_total_value) > 1e-6 * expected_total_value)
+        {
+            success = 0;
+            printf("Failed in %s mode with total %g not matching expected %g\n",
+                   halo_mode_names[mode], total, expected_total_value);
+        }
+    }
+
+    /* Measure the time per step for each mode, for a range of message
+     * sizes. Small messages show the setup cost of re-posting best. */
+    if (rank == 0)
+    {
+        printf("Time per step in microseconds over %d steps on %d ranks\n", n_repeats, size);
+        printf("%10s", "width");
+        for (int mode = 0; mode < 3; mode = mode + 1)
+        {
+            printf(" %12s", halo_mode_names[mode]);
+        }
+        printf("\n");
+    }
+    for (int w = 0; w < n_widths; w = w + 1)
+    {
+        if (rank == 0)
+        {
+            printf("%10d", widths[w]);
+        }
+        for (int mode = 0; mode < n_modes; mode = mode + 1)
+        {
+            initialize(rank, widths[w], data_sets[0]);
+            const double local_elapsed = run_steps(mode, n_repeats, 0, widths[w], data_sets,
+                                                   up_rank, down_rank, comm);
+            double elapsed;
+            MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+            if (rank == 0)
+            {
+                printf(" %12.3f", elapsed / n_repeats * 1e6);
+            }
+        }
+        if (rank == 0)
+        {
+            printf("%s\n", HAVE_PARTITIONED ? "" : "          n/a");
+        }
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(data_sets[0]);
+    free(data_sets[1]);
+    MPI_Finalize();
+    return 0;
+}
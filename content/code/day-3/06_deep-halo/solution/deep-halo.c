@@ -0,0 +1,236 @@
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Each rank owns n_rows full-width rows of the grid, stored with
+ * halo_depth ghost rows above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    /* Here is the 5-point stencil, scaled by 1/5 so that the total heat
+     * is conserved. The periodic wrap-around columns are peeled out of
+     * the loop over the other columns. */
+    output_row[0] = 0.2 * (this_row[0] + this_row[width - 1] + this_row[1 % width] +
+                           top_row[0] + bottom_row[0]);
+    for (int j = 1; j < width - 1; j = j + 1)
+    {
+        output_row[j] = 0.2 * (this_row[j] + this_row[j - 1] + this_row[j + 1] +
+                               top_row[j] + bottom_row[j]);
+    }
+    if (width > 1)
+    {
+        output_row[width - 1] = 0.2 * (this_row[width - 1] + this_row[width - 2] + this_row[0] +
+                                       top_row[width - 1] + bottom_row[width - 1]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Run max_step steps with a halo of halo_depth rows. Every exchange
+ * sends halo_depth rows in each direction, after which up to
+ * halo_depth steps are computed locally. Each of those steps also
+ * updates the ghost rows that the following steps still need, so the
+ * region computed shrinks by one row at each end per step. Returns the
+ * time taken and the sum of squares of the final grid. */
+double run_steps(int halo_depth, int max_step, int n_global_rows, int width,
+                 MPI_Comm comm, double *sum_of_squares)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    const int n_stored_rows = n_rows + 2 * halo_depth;
+    double *working_data_set = (double *)(calloc((size_t)n_stored_rows * width, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc((size_t)n_stored_rows * width, sizeof(double)));
+    for (int i = 0; i < n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(working_data_set, halo_depth + i, width)[j] = (double)((row_offset + i + 2 * j) % 7);
+        }
+    }
+
+    const int send_up_tag = 0, send_down_tag = 1;
+    const int first_owned_row = halo_depth, last_owned_row = halo_depth + n_rows - 1;
+    const int halo_size = halo_depth * width;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + halo_depth)
+    {
+        const int n_local_steps = (max_step - step < halo_depth) ? max_step - step : halo_depth;
+
+        /* Exchange halo_depth rows with each neighbour */
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, last_owned_row + 1, width), halo_size, MPI_DOUBLE,
+                  down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), halo_size, MPI_DOUBLE,
+                  up_rank, send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, first_owned_row, width), halo_size, MPI_DOUBLE,
+                  up_rank, send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, last_owned_row - halo_depth + 1, width), halo_size, MPI_DOUBLE,
+                  down_rank, send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation of the first step while the halo
+         * data is in flight */
+        for (int i = first_owned_row + 1; i < last_owned_row; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the rest of the steps, each on one row fewer at each end */
+        for (int local_step = 1; local_step <= n_local_steps; local_step = local_step + 1)
+        {
+            const int first_row = local_step, last_row = n_stored_rows - 1 - local_step;
+            for (int i = first_row; i <= last_row; i = i + 1)
+            {
+                if (local_step > 1 || i <= first_owned_row || i >= last_owned_row)
+                {
+                    compute_row(i, width, working_data_set, next_working_data_set);
+                }
+            }
+            double *temporary_data_set = working_data_set;
+            working_data_set = next_working_data_set;
+            next_working_data_set = temporary_data_set;
+        }
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+
+    double local_sum = 0;
+    for (int i = first_owned_row; i <= last_owned_row; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            local_sum += row(working_data_set, i, width)[j] * row(working_data_set, i, width)[j];
+        }
+    }
+    MPI_Allreduce(&local_sum, sum_of_squares, 1, MPI_DOUBLE, MPI_SUM, comm);
+    free(working_data_set);
+    free(next_working_data_set);
+
+    double max_elapsed;
+    MPI_Allreduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, comm);
+    return max_elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* By default sweep over a few square grids, otherwise use the
+     * grid given on the command line */
+    int grid_sizes[][2] = {{128, 128}, {512, 512}, {2048, 2048}};
+    int n_grids = sizeof(grid_sizes) / sizeof(grid_sizes[0]);
+    int max_step = 64;
+    if (argc > 1 && argc != 4)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    if (argc == 4)
+    {
+        grid_sizes[0][0] = atoi(argv[1]);
+        grid_sizes[0][1] = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+        n_grids = 1;
+    }
+
+    if (rank == 0)
+    {
+        printf("Deep-halo sweep over %d steps on %d ranks\n", max_step, size);
+        printf("%12s %8s %14s %10s\n", "grid", "depth", "time/step (s)", "messages");
+    }
+    int success = 1;
+    for (int g = 0; g < n_grids; g = g + 1)
+    {
+        const int n_global_rows = grid_sizes[g][0], width = grid_sizes[g][1];
+        if (n_global_rows < size)
+        {
+            if (rank == 0)
+            {
+                printf("%5d x %-5d skipped, fewer rows than ranks\n", n_global_rows, width);
+            }
+            continue;
+        }
+
+        /* Every rank must own at least as many rows as the halo is
+         * deep, since that is what it sends to each neighbour */
+        const int min_rows = n_global_rows / size;
+        double reference_sum = 0, best_time = 0;
+        int best_depth = 1;
+        for (int halo_depth = 1; halo_depth <= min_rows && halo_depth <= max_step; halo_depth = halo_depth * 2)
+        {
+            double sum_of_squares;
+            const double elapsed = run_steps(halo_depth, max_step, n_global_rows, width, comm, &sum_of_squares);
+            if (halo_depth == 1)
+            {
+                reference_sum = sum_of_squares;
+                best_time = elapsed;
+            }
+            else if (elapsed < best_time)
+            {
+                best_time = elapsed;
+                best_depth = halo_depth;
+            }
+            /* The redundant computation does exactly the same
+             * arithmetic as the neighbour, so the results must match
+             * bit for bit */
+            success = success && (sum_of_squares == reference_sum);
+            if (rank == 0)
+            {
+                printf("%5d x %-5d %8d %14.6g %10d\n", n_global_rows, width, halo_depth,
+                       elapsed / max_step, 4 * ((max_step + halo_depth - 1) / halo_depth));
+            }
+        }
+        if (rank == 0)
+        {
+            printf("%5d x %-5d best depth on %d ranks: %d\n", n_global_rows, width, size, best_depth);
+        }
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Persistent collectives, including the neighbourhood ones, arrived in
+ * MPI 4.0, so only use them when the library provides them */
+#if MPI_VERSION >= 4
+#define HAVE_PERSISTENT_COLLECTIVES 1
+#else
+#define HAVE_PERSISTENT_COLLECTIVES 0
+#endif
+
+/* The halo exchange can be four pairs of point-to-point messages, or a
+ * single neighbourhood collective over the same neighbours, which can
+ * also be set up once as a persistent request. */
+enum halo_mode
+{
+    POINT_TO_POINT = 0,
+    NEIGHBOR = 1,
+    PERSISTENT_NEIGHBOR = 2
+};
+const char *halo_mode_names[] = {"Isend/Irecv", "Ineighbor_alltoallw", "Neighbor_alltoallw_init"};
+
+/* Each rank owns a tile of n_rows x n_columns cells of the global
+ * grid.  The tile is stored on the heap with one ghost row above and
+ * below and one ghost column left and right, ie as
+ * (n_rows+2) x (n_columns+2) values in row-major order. */
+#define INDEX(i, j, n_columns) ((size_t)(i) * (size_t)((n_columns) + 2) + (size_t)(j))
+
+void compute_row(int row_index, int first_column, int last_column, int n_columns,
+                 const double *input, double *output)
+{
+    const size_t stride = (size_t)n_columns + 2;
+    for (int j = first_column; j <= last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat on the periodic domain is conserved */
+        const size_t center = INDEX(row_index, j, n_columns);
+        output[center] = 0.2 * (input[center] +
+                                input[center - 1] +
+                                input[center + 1] +
+                                input[center - stride] +
+                                input[center + stride]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Make one subarray datatype per direction for the border cells sent,
+ * and one for the ghost cells received. They all describe pieces of
+ * the whole tile, so every message starts from the first value of the
+ * tile. The directions are in the order up, down, left, right. */
+void create_halo_types(int n_rows, int n_columns, MPI_Datatype send_types[4], MPI_Datatype recv_types[4])
+{
+    const int sizes[2] = {n_rows + 2, n_columns + 2};
+    const int row_subsizes[2] = {1, n_columns}, column_subsizes[2] = {n_rows, 1};
+    const int *subsizes[4] = {row_subsizes, row_subsizes, column_subsizes, column_subsizes};
+    const int send_starts[4][2] = {{1, 1}, {n_rows, 1}, {1, 1}, {1, n_columns}};
+    const int recv_starts[4][2] = {{0, 1}, {n_rows + 1, 1}, {1, 0}, {1, n_columns + 1}};
+    for (int d = 0; d < 4; d = d + 1)
+    {
+        MPI_Type_create_subarray(2, sizes, subsizes[d], send_starts[d], MPI_ORDER_C, MPI_DOUBLE, &send_types[d]);
+        MPI_Type_commit(&send_types[d]);
+        MPI_Type_create_subarray(2, sizes, subsizes[d], recv_starts[d], MPI_ORDER_C, MPI_DOUBLE, &recv_types[d]);
+        MPI_Type_commit(&recv_types[d]);
+    }
+}
+
+/* Make a distributed graph communicator over the same ranks as the
+ * periodic Cartesian communicator comm, for the neighbourhood
+ * collectives. The ranks keep their numbers. Messages between the same
+ * pair of ranks are matched in the order of the neighbour lists. The
+ * sources are listed as up, down, left, right, so the destinations are
+ * listed as down, up, right, left: what we send down is what our down
+ * neighbour receives from up. This also holds when a dimension has only
+ * one or two ranks, so that both neighbours are the same rank, which
+ * some libraries get wrong for Cartesian communicators. */
+MPI_Comm create_halo_graph(MPI_Comm comm)
+{
+    int sources[4], destinations[4];
+    const int weights[4] = {1, 1, 1, 1};
+    MPI_Cart_shift(comm, 0, 1, &sources[0], &sources[1]);
+    MPI_Cart_shift(comm, 1, 1, &sources[2], &sources[3]);
+    for (int k = 0; k < 4; k = k + 1)
+    {
+        destinations[k] = sources[k ^ 1];
+    }
+    MPI_Comm graph_comm;
+    MPI_Dist_graph_create_adjacent(comm, 4, sources, weights, 4, destinations, weights,
+                                   MPI_INFO_NULL, 0, &graph_comm);
+    return graph_comm;
+}
+
+/* Run max_step steps on the periodic Cartesian communicator comm, using
+ * the given kind of halo exchange. The neighbourhood collectives use
+ * graph_comm, made by create_halo_graph. Returns the time taken on this
+ * rank, and the total heat and sum of squares over all ranks. */
+double run_steps(enum halo_mode mode, int max_step, int n_global_rows, int n_global_columns,
+                 MPI_Comm comm, MPI_Comm graph_comm, double *total, double *sum_of_squares)
+{
+    int rank, dims[2], periods[2], coords[2];
+    MPI_Comm_rank(comm, &rank);
+    MPI_Cart_get(comm, 2, dims, periods, coords);
+    int neighbours[4];
+    MPI_Cart_shift(comm, 0, 1, &neighbours[0], &neighbours[1]);
+    MPI_Cart_shift(comm, 1, 1, &neighbours[2], &neighbours[3]);
+    int n_rows, n_columns, row_offset, column_offset;
+    decompose(n_global_rows, dims[0], coords[0], &n_rows, &row_offset);
+    decompose(n_global_columns, dims[1], coords[1], &n_columns, &column_offset);
+
+    /* Prepare the initial values for this process. They depend only
+     * on the global position of each cell. */
+    const size_t n_values = (size_t)(n_rows + 2) * (size_t)(n_columns + 2);
+    double *data_sets[2];
+    data_sets[0] = (double *)(calloc(n_values, sizeof(double)));
+    data_sets[1] = (double *)(calloc(n_values, sizeof(double)));
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const int global_i = row_offset + i - 1;
+            const int global_j = column_offset + j - 1;
+            data_sets[0][INDEX(i, j, n_columns)] = (double)((global_i + 2 * global_j) % 7);
+        }
+    }
+
+    /* The datatypes are made once, and serve every step and both
+     * buffers. Each neighbour gets one instance of its type. */
+    MPI_Datatype send_types[4], recv_types[4];
+    create_halo_types(n_rows, n_columns, send_types, recv_types);
+    MPI_Datatype graph_send_types[4];
+    for (int k = 0; k < 4; k = k + 1)
+    {
+        graph_send_types[k] = send_types[k ^ 1];
+    }
+    const int counts[4] = {1, 1, 1, 1};
+    const MPI_Aint displacements[4] = {0, 0, 0, 0};
+
+    /* A persistent exchange is bound to its buffer, so make one for
+     * each of the two buffers that the steps alternate between */
+    MPI_Request persistent_requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+#if HAVE_PERSISTENT_COLLECTIVES
+    if (mode == PERSISTENT_NEIGHBOR)
+    {
+        for (int p = 0; p < 2; p = p + 1)
+        {
+            MPI_Neighbor_alltoallw_init(data_sets[p], counts, displacements, graph_send_types,
+                                        data_sets[p], counts, displacements, recv_types,
+                                        graph_comm, MPI_INFO_NULL, &persistent_requests[p]);
+        }
+    }
+#endif
+
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        const int p = step % 2;
+        double *working_data_set = data_sets[p];
+        double *next_working_data_set = data_sets[1 - p];
+
+        /* Start the halo exchange */
+        MPI_Request requests[8];
+        int n_requests = 1;
+        if (mode == POINT_TO_POINT)
+        {
+            /* What is sent in direction d arrives from the opposite
+             * direction, d ^ 1, so the direction is also the tag */
+            for (int d = 0; d < 4; d = d + 1)
+            {
+                MPI_Irecv(working_data_set, 1, recv_types[d], neighbours[d], d ^ 1, comm, &requests[d]);
+            }
+            for (int d = 0; d < 4; d = d + 1)
+            {
+                MPI_Isend(working_data_set, 1, send_types[d], neighbours[d], d, comm, &requests[4 + d]);
+            }
+            n_requests = 8;
+        }
+        else if (mode == NEIGHBOR)
+        {
+            MPI_Ineighbor_alltoallw(working_data_set, counts, displacements, graph_send_types,
+                                    working_data_set, counts, displacements, recv_types,
+                                    graph_comm, &requests[0]);
+        }
+        else
+        {
+            requests[0] = persistent_requests[p];
+            MPI_Start(&requests[0]);
+        }
+
+        /* Do the local computation, which needs no halo data */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 2, n_columns - 1, n_columns, working_data_set, next_working_data_set);
+        }
+
+        /* Wait for the halo exchange to complete */
+        MPI_Waitall(n_requests, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation on the border of the tile */
+        compute_row(1, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        }
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 1, 1, n_columns, working_data_set, next_working_data_set);
+            if (n_columns > 1)
+            {
+                compute_row(i, n_columns, n_columns, n_columns, working_data_set, next_working_data_set);
+            }
+        }
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+
+    double local_sums[2] = {0, 0}, sums[2];
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const double value = data_sets[max_step % 2][INDEX(i, j, n_columns)];
+            local_sums[0] += value;
+            local_sums[1] += value * value;
+        }
+    }
+    MPI_Allreduce(local_sums, sums, 2, MPI_DOUBLE, MPI_SUM, comm);
+    *total = sums[0];
+    *sum_of_squares = sums[1];
+
+    /* Clean up */
+    for (int p = 0; p < 2; p = p + 1)
+    {
+        if (persistent_requests[p] != MPI_REQUEST_NULL)
+        {
+            MPI_Request_free(&persistent_requests[p]);
+        }
+    }
+    for (int d = 0; d < 4; d = d + 1)
+    {
+        MPI_Type_free(&send_types[d]);
+        MPI_Type_free(&recv_types[d]);
+    }
+    free(data_sets[0]);
+    free(data_sets[1]);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment */
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* Read the global grid size and number of steps */
+    int n_global_rows = 512, n_global_columns = 512, max_step = 200;
+    if (argc > 1 && argc != 4)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps]\n", argv[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (argc == 4)
+    {
+        n_global_rows = atoi(argv[1]);
+        n_global_columns = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+    }
+
+    /* Arrange the ranks in a periodic 2D Cartesian grid. The topologies
+     * are made once, and tell the neighbourhood collectives who the
+     * neighbours are. */
+    int dims[2] = {0, 0}, periods[2] = {1, 1};
+    MPI_Dims_create(size, 2, dims);
+    MPI_Comm comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &comm);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm graph_comm = create_halo_graph(comm);
+    if (n_global_rows < dims[0] || n_global_columns < dims[1] || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "A %d x %d grid can't be split over %d x %d ranks\n",
+                    n_global_rows, n_global_columns, dims[0], dims[1]);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* Run every kind of halo exchange, and check that they compute
+     * the same steps and conserve the total heat */
+    const int n_modes = HAVE_PERSISTENT_COLLECTIVES ? 3 : 2;
+    double initial_total, initial_sum_of_squares;
+    run_steps(POINT_TO_POINT, 0, n_global_rows, n_global_columns, comm, graph_comm,
+              &initial_total, &initial_sum_of_squares);
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d x %d ranks, %d steps\n",
+               n_global_rows, n_global_columns, dims[0], dims[1], max_step);
+        printf("%24s %16s %20s\n", "halo exchange", "time/step (s)", "sum of squares");
+    }
+    int success = 1;
+    double reference_sum_of_squares = 0;
+    for (int mode = 0; mode < n_modes; mode = mode + 1)
+    {
+        double total, sum_of_squares;
+        const double local_elapsed = run_steps(mode, max_step, n_global_rows, n_global_columns, comm,
+                                               graph_comm, &total, &sum_of_squares);
+        double elapsed;
+        MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+        if (mode == POINT_TO_POINT)
+        {
+            reference_sum_of_squares = sum_of_squares;
+        }
+        success = success && (sum_of_squares == reference_sum_of_squares) &&
+                  (fabs(total - initial_total) <= 1e-9 * fabs(initial_total));
+        if (rank == 0)
+        {
+            printf("%24s %16.6g %20.12g\n", halo_mode_names[mode],
+                   (max_step > 0) ? elapsed / max_step : 0.0, sum_of_squares);
+        }
+    }
+    if (rank == 0 && !HAVE_PERSISTENT_COLLECTIVES)
+    {
+        printf("%24s %16s\n", halo_mode_names[PERSISTENT_NEIGHBOR], "n/a");
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Comm_free(&graph_comm);
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,429 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The diagnostics of one step. The total heat and the sum of the
+ * squared changes are summed over ranks. The largest value, the
+ * largest negated value (ie. the smallest value) and the largest
+ * change are maximized over ranks. */
+enum
+{
+    TOTAL = 0,
+    RESIDUAL_SQUARED = 1,
+    N_SUMS = 2
+};
+enum
+{
+    MAXIMUM = 0,
+    NEGATED_MINIMUM = 1,
+    RESIDUAL_MAXIMUM = 2,
+    N_MAXIMA = 3
+};
+struct diagnostics
+{
+    int step;
+    double sums[N_SUMS];
+    double maxima[N_MAXIMA];
+};
+
+/* A reduction in flight. It keeps its own copy of the local values, so
+ * that the grid can move on while the reduction completes. */
+struct diagnostics_slot
+{
+    struct diagnostics local, global;
+    MPI_Request requests[2];
+};
+
+/* Start a reduction of the diagnostics every interval steps, and
+ * complete it lag steps later. When lag is not less than interval,
+ * several reductions are in flight at once, each in its own slot.
+ * The slots are used in turn, so the reductions complete in the order
+ * they started. With blocking set, MPI_Allreduce is used instead, which
+ * is what the other variants are compared against. */
+struct diagnostics_scheduler
+{
+    int interval, lag, blocking;
+    int n_slots;
+    struct diagnostics_slot *slots;
+    int n_started, n_completed;
+    MPI_Comm comm;
+
+    /* The completed diagnostics, in order */
+    struct diagnostics *results;
+
+    /* Time spent waiting for reductions, and the number of steps that
+     * were computed while they were in flight */
+    double wait_time;
+    long n_hidden_steps;
+};
+
+void init_diagnostics_scheduler(struct diagnostics_scheduler *scheduler, int interval, int lag,
+                                int blocking, int max_step, MPI_Comm comm)
+{
+    scheduler->interval = interval;
+    scheduler->lag = lag;
+    scheduler->blocking = blocking;
+    scheduler->n_slots = lag / interval + 1;
+    scheduler->slots = (struct diagnostics_slot *)(malloc(sizeof(struct diagnostics_slot) * scheduler->n_slots));
+    scheduler->n_started = 0;
+    scheduler->n_completed = 0;
+    scheduler->comm = comm;
+    scheduler->results = (struct diagnostics *)(malloc(sizeof(struct diagnostics) * (max_step / interval + 1)));
+    scheduler->wait_time = 0;
+    scheduler->n_hidden_steps = 0;
+}
+
+void free_diagnostics_scheduler(struct diagnostics_scheduler *scheduler)
+{
+    free(scheduler->slots);
+    free(scheduler->results);
+}
+
+/* Whether the diagnostics of this step should be reduced */
+int diagnostics_due(const struct diagnostics_scheduler *scheduler, int step)
+{
+    return step % scheduler->interval == scheduler->interval - 1;
+}
+
+/* Wait for the oldest reduction in flight, which is completed at the
+ * given step */
+void complete_oldest_diagnostics(struct diagnostics_scheduler *scheduler, int step)
+{
+    struct diagnostics_slot *slot = &scheduler->slots[scheduler->n_completed % scheduler->n_slots];
+    const double start_time = MPI_Wtime();
+    MPI_Waitall(2, slot->requests, MPI_STATUSES_IGNORE);
+    scheduler->wait_time += MPI_Wtime() - start_time;
+    scheduler->n_hidden_steps += step - slot->local.step;
+    slot->global.step = slot->local.step;
+    scheduler->results[scheduler->n_completed] = slot->global;
+    scheduler->n_completed = scheduler->n_completed + 1;
+}
+
+/* Start reducing the local diagnostics of a step */
+void start_diagnostics(struct diagnostics_scheduler *scheduler, const struct diagnostics *local)
+{
+    if (scheduler->blocking)
+    {
+        struct diagnostics global;
+        const double start_time = MPI_Wtime();
+        MPI_Allreduce(local->sums, global.sums, N_SUMS, MPI_DOUBLE, MPI_SUM, scheduler->comm);
+        MPI_Allreduce(local->maxima, global.maxima, N_MAXIMA, MPI_DOUBLE, MPI_MAX, scheduler->comm);
+        scheduler->wait_time += MPI_Wtime() - start_time;
+        global.step = local->step;
+        scheduler->results[scheduler->n_completed] = global;
+        scheduler->n_started = scheduler->n_started + 1;
+        scheduler->n_completed = scheduler->n_completed + 1;
+        return;
+    }
+
+    /* If every slot is in flight, the oldest one has to finish first.
+     * This only happens when it is due at this step anyway. */
+    if (scheduler->n_started - scheduler->n_completed == scheduler->n_slots)
+    {
+        complete_oldest_diagnostics(scheduler, local->step);
+    }
+    struct diagnostics_slot *slot = &scheduler->slots[scheduler->n_started % scheduler->n_slots];
+    slot->local = *local;
+    MPI_Iallreduce(slot->local.sums, slot->global.sums, N_SUMS, MPI_DOUBLE, MPI_SUM,
+                   scheduler->comm, &slot->requests[0]);
+    MPI_Iallreduce(slot->local.maxima, slot->global.maxima, N_MAXIMA, MPI_DOUBLE, MPI_MAX,
+                   scheduler->comm, &slot->requests[1]);
+    scheduler->n_started = scheduler->n_started + 1;
+}
+
+/* Complete every reduction that is due by this step */
+void progress_diagnostics(struct diagnostics_scheduler *scheduler, int step)
+{
+    while (scheduler->n_completed < scheduler->n_started &&
+           scheduler->slots[scheduler->n_completed % scheduler->n_slots].local.step + scheduler->lag <= step)
+    {
+        complete_oldest_diagnostics(scheduler, step);
+    }
+}
+
+/* Complete every reduction still in flight after the last step */
+void finish_diagnostics(struct diagnostics_scheduler *scheduler, int step)
+{
+    while (scheduler->n_completed < scheduler->n_started)
+    {
+        complete_oldest_diagnostics(scheduler, step);
+    }
+}
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    /* Here is the 5-point stencil, scaled by 1/5 so that the total heat
+     * is conserved. The periodic wrap-around columns are peeled out of
+     * the loop over the other columns. */
+    output_row[0] = 0.2 * (this_row[0] + this_row[width - 1] + this_row[1 % width] +
+                           top_row[0] + bottom_row[0]);
+    for (int j = 1; j < width - 1; j = j + 1)
+    {
+        output_row[j] = 0.2 * (this_row[j] + this_row[j - 1] + this_row[j + 1] +
+                               top_row[j] + bottom_row[j]);
+    }
+    if (width > 1)
+    {
+        output_row[width - 1] = 0.2 * (this_row[width - 1] + this_row[width - 2] + this_row[0] +
+                                       top_row[width - 1] + bottom_row[width - 1]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Find the local diagnostics of the step that turned input into
+ * output */
+void compute_local_diagnostics(int step, int n_rows, int width, double *input, double *output,
+                               struct diagnostics *local)
+{
+    local->step = step;
+    local->sums[TOTAL] = 0;
+    local->sums[RESIDUAL_SQUARED] = 0;
+    local->maxima[MAXIMUM] = -INFINITY;
+    local->maxima[NEGATED_MINIMUM] = -INFINITY;
+    local->maxima[RESIDUAL_MAXIMUM] = 0;
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            const double value = row(output, i, width)[j];
+            const double change = value - row(input, i, width)[j];
+            local->sums[TOTAL] += value;
+            local->sums[RESIDUAL_SQUARED] += change * change;
+            local->maxima[MAXIMUM] = fmax(local->maxima[MAXIMUM], value);
+            local->maxima[NEGATED_MINIMUM] = fmax(local->maxima[NEGATED_MINIMUM], -value);
+            local->maxima[RESIDUAL_MAXIMUM] = fmax(local->maxima[RESIDUAL_MAXIMUM], fabs(change));
+        }
+    }
+}
+
+/* Run max_step steps on the ring of ranks, reducing the diagnostics as
+ * the scheduler says. Returns the time taken on this rank. */
+double run_steps(struct diagnostics_scheduler *scheduler, int max_step, int n_global_rows, int width,
+                 MPI_Comm comm)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    double *working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(working_data_set, i, width)[j] = (double)((row_offset + i - 1 + 2 * j) % 7);
+        }
+    }
+
+    const int send_up_tag = 0, send_down_tag = 1;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        /* Exchange the halos */
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation */
+        compute_row(1, width, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, width, working_data_set, next_working_data_set);
+        }
+
+        /* Start the diagnostics of this step if they are due, and
+         * complete those of earlier steps that are due */
+        if (diagnostics_due(scheduler, step))
+        {
+            struct diagnostics local;
+            compute_local_diagnostics(step, n_rows, width, working_data_set, next_working_data_set, &local);
+            start_diagnostics(scheduler, &local);
+        }
+        progress_diagnostics(scheduler, step);
+
+        /* Prepare to iterate by swapping the buffers */
+        double *temporary_data_set = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary_data_set;
+    }
+    /* Whatever is still in flight completes after the last step that
+     * was run, max_step - 1 */
+    finish_diagnostics(scheduler, max_step - 1);
+    const double elapsed = MPI_Wtime() - start_time;
+
+    free(working_data_set);
+    free(next_working_data_set);
+    return elapsed;
+}
+
+/* Whether two sets of diagnostics agree. The sums may be added up in
+ * different orders by the blocking and non-blocking reductions. */
+int diagnostics_match(const struct diagnostics *a, const struct diagnostics *b)
+{
+    int match = (a->step == b->step);
+    for (int k = 0; k < N_SUMS; k = k + 1)
+    {
+        match = match && (fabs(a->sums[k] - b->sums[k]) <= 1e-12 * fabs(b->sums[k]));
+    }
+    for (int k = 0; k < N_MAXIMA; k = k + 1)
+    {
+        match = match && (a->maxima[k] == b->maxima[k]);
+    }
+    return match;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Read the global grid size and number of steps */
+    int n_global_rows = 256, width = 256, max_step = 1000;
+    if (argc > 1 && argc != 4)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    if (argc == 4)
+    {
+        n_global_rows = atoi(argv[1]);
+        width = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+    }
+    if (n_global_rows < size || width < 1 || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "A %d x %d grid can't be split over %d ranks\n", n_global_rows, width, size);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* The diagnostics of every step, reduced with blocking calls, are
+     * the reference for all the other schedules */
+    struct diagnostics_scheduler reference;
+    init_diagnostics_scheduler(&reference, 1, 0, 1, max_step, comm);
+    run_steps(&reference, max_step, n_global_rows, width, comm);
+
+    /* Try a few schedules, including the one from the ireduce
+     * exercise: every 5 steps, completed 4 steps later. Each is
+     * compared with blocking reductions at the same interval. */
+    const int schedules[][2] = {{1, 0}, {1, 1}, {1, 4}, {5, 4}, {5, 10}, {10, 20}};
+    const int n_schedules = sizeof(schedules) / sizeof(schedules[0]);
+    if (rank == 0)
+    {
+        printf("Diagnostics of a %d x %d grid over %d steps on %d ranks\n", n_global_rows, width, max_step, size);
+        printf("%8s %5s %9s %14s %14s %14s %14s %12s\n", "interval", "lag", "in flight",
+               "time/step (s)", "blocking (s)", "wait/reduction", "blocking wait", "steps hidden");
+    }
+    int success = 1;
+    for (int s = 0; s < n_schedules; s = s + 1)
+    {
+        const int interval = schedules[s][0], lag = schedules[s][1];
+        struct diagnostics_scheduler schedulers[2];
+        double local_times[4], times[4];
+        for (int blocking = 0; blocking < 2; blocking = blocking + 1)
+        {
+            struct diagnostics_scheduler *scheduler = &schedulers[blocking];
+            init_diagnostics_scheduler(scheduler, interval, lag, blocking, max_step, comm);
+            local_times[blocking] = run_steps(scheduler, max_step, n_global_rows, width, comm);
+            local_times[2 + blocking] = scheduler->wait_time;
+
+            /* Every step that was reduced must match the reference */
+            success = success && (scheduler->n_completed == max_step / interval);
+            for (int k = 0; k < scheduler->n_completed; k = k + 1)
+            {
+                const struct diagnostics *result = &scheduler->results[k];
+                success = success && diagnostics_match(result, &reference.results[result->step]);
+            }
+        }
+        MPI_Reduce(local_times, times, 4, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+        /* Report the time lost waiting for each reduction, against that
+         * of a blocking reduction, and how many steps of computation
+         * each reduction overlapped */
+        const int n_reductions = schedulers[0].n_completed;
+        if (rank == 0 && n_reductions > 0)
+        {
+            printf("%8d %5d %9d %14.6g %14.6g %14.6g %14.6g %12.2f\n", interval, lag, schedulers[0].n_slots,
+                   times[0] / max_step, times[1] / max_step, times[2] / n_reductions, times[3] / n_reductions,
+                   (double)schedulers[0].n_hidden_steps / n_reductions);
+        }
+        free_diagnostics_scheduler(&schedulers[0]);
+        free_diagnostics_scheduler(&schedulers[1]);
+    }
+
+    /* Show the diagnostics of the last step */
+    if (rank == 0 && max_step > 0)
+    {
+        const struct diagnostics *last = &reference.results[max_step - 1];
+        printf("Step %d: total %.12g, range [%g, %g], residual L2 %g, Linf %g\n", last->step, last->sums[TOTAL],
+               -last->maxima[NEGATED_MINIMUM], last->maxima[MAXIMUM], sqrt(last->sums[RESIDUAL_SQUARED]),
+               last->maxima[RESIDUAL_MAXIMUM]);
+    }
+    free_diagnostics_scheduler(&reference);
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Finalize();
+    return 0;
+}
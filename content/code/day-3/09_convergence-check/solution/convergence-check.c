@@ -0,0 +1,321 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The residual of a step is the change it made to the grid, measured
+ * either as the square root of the sum of squared changes over all
+ * cells, or as the largest change of any cell */
+enum residual_norm
+{
+    L2 = 0,
+    LINF = 1
+};
+const char *residual_norm_names[] = {"L2", "Linf"};
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+/* Update one row, and add its contribution to the residual while the
+ * values are still in registers, rather than in another pass over the
+ * grid */
+void compute_row(int row_index, int width, double *input, double *output,
+                 double *residual_squared, double *residual_max)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    double sum = 0, max = 0;
+    for (int j = 0; j < width; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat is conserved */
+        const int right_column_index = (j == width - 1) ? 0 : j + 1;
+        const int left_column_index = (j == 0) ? width - 1 : j - 1;
+        output_row[j] = 0.2 * (this_row[j] + this_row[left_column_index] + this_row[right_column_index] +
+                               top_row[j] + bottom_row[j]);
+        const double change = output_row[j] - this_row[j];
+        sum += change * change;
+        max = fmax(max, fabs(change));
+    }
+    *residual_squared += sum;
+    *residual_max = fmax(*residual_max, max);
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* The residual of one step, while it is being reduced. Each step needs
+ * its own, because several can be in flight. */
+struct residual_slot
+{
+    int step;
+    double local[2], global[2];
+    MPI_Request requests[2];
+};
+
+/* The outcome of iterating to the tolerance */
+struct convergence
+{
+    int n_steps;
+    int converged_step;
+    double residuals[2];
+};
+
+/* Step until the residual of a step is below tolerance, or for
+ * max_step steps. With lag 0, the residual of every step is reduced
+ * with a blocking MPI_Allreduce before the next step starts. Otherwise
+ * it is reduced with MPI_Iallreduce and only waited for lag steps
+ * later, so the loop never stalls, but runs lag more steps than it
+ * needs. Returns the time taken on this rank. */
+double run_to_tolerance(int lag, enum residual_norm norm, double tolerance, int max_step,
+                        int n_global_rows, int width, MPI_Comm comm, struct convergence *result)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    double *working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc((size_t)(n_rows + 2) * width, sizeof(double)));
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(working_data_set, i, width)[j] = (double)((row_offset + i - 1 + 2 * j) % 7);
+        }
+    }
+
+    /* A residual started at step s is waited for at step s + lag, so
+     * at most lag + 1 are in flight */
+    const int n_slots = lag + 1;
+    struct residual_slot *slots = (struct residual_slot *)(malloc(sizeof(struct residual_slot) * n_slots));
+    int n_started = 0, n_completed = 0;
+
+    result->converged_step = -1;
+    const int send_up_tag = 0, send_down_tag = 1;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    int step = 0;
+    while (step < max_step && result->converged_step < 0)
+    {
+        /* Exchange the halos */
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation */
+        struct residual_slot *slot = &slots[n_started % n_slots];
+        slot->step = step;
+        slot->local[L2] = 0;
+        slot->local[LINF] = 0;
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set, &slot->local[L2], &slot->local[LINF]);
+        }
+        MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation */
+        compute_row(1, width, working_data_set, next_working_data_set, &slot->local[L2], &slot->local[LINF]);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, width, working_data_set, next_working_data_set,
+                        &slot->local[L2], &slot->local[LINF]);
+        }
+
+        /* Combine the residual over the ranks */
+        if (lag == 0)
+        {
+            MPI_Allreduce(&slot->local[L2], &slot->global[L2], 1, MPI_DOUBLE, MPI_SUM, comm);
+            MPI_Allreduce(&slot->local[LINF], &slot->global[LINF], 1, MPI_DOUBLE, MPI_MAX, comm);
+            slot->requests[0] = MPI_REQUEST_NULL;
+            slot->requests[1] = MPI_REQUEST_NULL;
+        }
+        else
+        {
+            MPI_Iallreduce(&slot->local[L2], &slot->global[L2], 1, MPI_DOUBLE, MPI_SUM, comm, &slot->requests[0]);
+            MPI_Iallreduce(&slot->local[LINF], &slot->global[LINF], 1, MPI_DOUBLE, MPI_MAX, comm, &slot->requests[1]);
+        }
+        n_started = n_started + 1;
+
+        /* Check the residual that is due at this step. Every rank sees
+         * the same global residual, so they all stop after the same
+         * step. */
+        if (n_started - n_completed > lag)
+        {
+            struct residual_slot *oldest_slot = &slots[n_completed % n_slots];
+            MPI_Waitall(2, oldest_slot->requests, MPI_STATUSES_IGNORE);
+            n_completed = n_completed + 1;
+            const double residual = (norm == L2) ? sqrt(oldest_slot->global[L2]) : oldest_slot->global[LINF];
+            if (residual < tolerance)
+            {
+                result->converged_step = oldest_slot->step;
+                result->residuals[L2] = sqrt(oldest_slot->global[L2]);
+                result->residuals[LINF] = oldest_slot->global[LINF];
+            }
+        }
+
+        /* Prepare to iterate by swapping the buffers */
+        double *temporary_data_set = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary_data_set;
+        step = step + 1;
+    }
+
+    /* Don't leave any reductions behind */
+    while (n_completed < n_started)
+    {
+        MPI_Waitall(2, slots[n_completed % n_slots].requests, MPI_STATUSES_IGNORE);
+        n_completed = n_completed + 1;
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+    result->n_steps = step;
+
+    free(slots);
+    free(working_data_set);
+    free(next_working_data_set);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Read the global grid size and the tolerance on the residual */
+    int n_global_rows = 128, width = 128, max_step = 100000;
+    double tolerance = 1e-4;
+    enum residual_norm norm = LINF;
+    int n_arguments = 0;
+    double arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--norm") == 0 && k + 1 < argc &&
+            (strcmp(argv[k + 1], "l2") == 0 || strcmp(argv[k + 1], "linf") == 0))
+        {
+            norm = (strcmp(argv[k + 1], "l2") == 0) ? L2 : LINF;
+            k = k + 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atof(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = (int)arguments[0];
+        width = (int)arguments[1];
+        tolerance = arguments[2];
+    }
+    if ((n_arguments != 0 && n_arguments != 3) || n_global_rows < size || width < 1 || tolerance <= 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns tolerance] [--norm l2|linf]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* Iterate to the tolerance with a blocking check on every step, and
+     * then with checks that lag behind by a few steps */
+    if (rank == 0)
+    {
+        printf("Iterating a %d x %d grid on %d ranks until the %s residual is below %g\n",
+               n_global_rows, width, size, residual_norm_names[norm], tolerance);
+        printf("%10s %10s %10s %14s %14s %14s %14s\n", "lag", "converged", "steps", "time (s)",
+               "time/step (s)", "L2 residual", "Linf residual");
+    }
+    const int lags[] = {0, 1, 2, 4, 8};
+    const int n_lags = sizeof(lags) / sizeof(lags[0]);
+    int success = 1, reference_converged_step = -1;
+    for (int l = 0; l < n_lags; l = l + 1)
+    {
+        struct convergence result;
+        const double local_elapsed = run_to_tolerance(lags[l], norm, tolerance, max_step, n_global_rows, width,
+                                                      comm, &result);
+        double elapsed;
+        MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+        /* Every schedule must see the tolerance met on the same step,
+         * and then run exactly lag more */
+        if (lags[l] == 0)
+        {
+            reference_converged_step = result.converged_step;
+        }
+        success = success && (result.converged_step >= 0) &&
+                  (result.converged_step == reference_converged_step) &&
+                  (result.n_steps == result.converged_step + 1 + lags[l]);
+        if (rank == 0)
+        {
+            char label[16];
+            if (lags[l] == 0)
+            {
+                snprintf(label, sizeof(label), "blocking");
+            }
+            else
+            {
+                snprintf(label, sizeof(label), "%d", lags[l]);
+            }
+            if (result.converged_step < 0)
+            {
+                printf("%10s did not converge in %d steps\n", label, max_step);
+            }
+            else
+            {
+                printf("%10s %10d %10d %14.6g %14.6g %14.6g %14.6g\n", label, result.converged_step,
+                       result.n_steps, elapsed, elapsed / result.n_steps, result.residuals[L2],
+                       result.residuals[LINF]);
+            }
+        }
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Finalize();
+    return 0;
+}
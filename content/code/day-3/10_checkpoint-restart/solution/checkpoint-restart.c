@@ -0,0 +1,523 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A checkpoint file starts with a header, padded to HEADER_SIZE bytes,
+ * followed by the whole grid as doubles in row-major order. The header
+ * is written only once the grid is safely in the file, so a file whose
+ * header has the magic number holds a complete checkpoint. Checkpoints
+ * alternate between two files, so that if a run fails while writing
+ * one, the other is still good. */
+#define HEADER_SIZE 64
+#define CHECKPOINT_MAGIC 0x48454154
+enum
+{
+    HEADER_MAGIC = 0,
+    HEADER_N_ROWS = 1,
+    HEADER_N_COLUMNS = 2,
+    HEADER_STEP = 3,
+    HEADER_INTS = 4
+};
+
+/* Each rank owns a tile of n_rows x n_columns cells of the global
+ * grid.  The tile is stored on the heap with one ghost row above and
+ * below and one ghost column left and right, ie as
+ * (n_rows+2) x (n_columns+2) values in row-major order. */
+#define INDEX(i, j, n_columns) ((size_t)(i) * (size_t)((n_columns) + 2) + (size_t)(j))
+
+struct tile
+{
+    int n_global_rows, n_global_columns;
+    int n_rows, n_columns;
+    int row_offset, column_offset;
+};
+
+void compute_row(int row_index, int first_column, int last_column, int n_columns,
+                 const double *input, double *output)
+{
+    const size_t stride = (size_t)n_columns + 2;
+    for (int j = first_column; j <= last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat on the periodic domain is conserved */
+        const size_t center = INDEX(row_index, j, n_columns);
+        output[center] = 0.2 * (input[center] +
+                                input[center - 1] +
+                                input[center + 1] +
+                                input[center - stride] +
+                                input[center + stride]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Make this rank see only its own tile of the grid in the file, so
+ * that all ranks can read or write the whole grid with one collective
+ * call, whatever the decomposition */
+void set_tile_view(MPI_File file, const struct tile *tile)
+{
+    const int sizes[2] = {tile->n_global_rows, tile->n_global_columns};
+    const int subsizes[2] = {tile->n_rows, tile->n_columns};
+    const int starts[2] = {tile->row_offset, tile->column_offset};
+    MPI_Datatype file_type;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &file_type);
+    MPI_Type_commit(&file_type);
+    MPI_File_set_view(file, HEADER_SIZE, MPI_DOUBLE, file_type, "native", MPI_INFO_NULL);
+    MPI_Type_free(&file_type);
+}
+
+/* A checkpoint being written. The owned cells are copied into a buffer
+ * first, so that the steps can carry on changing the grid while the
+ * write drains. */
+struct checkpoint
+{
+    MPI_File file;
+    MPI_Request request;
+    double *buffer;
+    int header[HEADER_INTS];
+    int in_flight, complete;
+    double start_time, completion_time;
+
+    /* Which of the two files the next checkpoint goes to */
+    int file_index;
+
+    /* Totals over all the checkpoints of the run */
+    int n_written;
+    double bytes_written, write_time, blocked_time;
+};
+
+/* Start writing the owned cells of data_set, as they are after the
+ * given step. With blocking set, the write is finished before
+ * returning. */
+void start_checkpoint(struct checkpoint *checkpoint, const char *prefix, int step, const struct tile *tile,
+                      const double *data_set, int blocking, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const double start_time = MPI_Wtime();
+    for (int i = 1; i <= tile->n_rows; i = i + 1)
+    {
+        memcpy(&checkpoint->buffer[(size_t)(i - 1) * tile->n_columns],
+               &data_set[INDEX(i, 1, tile->n_columns)], sizeof(double) * tile->n_columns);
+    }
+
+    char file_name[1024];
+    snprintf(file_name, sizeof(file_name), "%s-%d.chk", prefix, checkpoint->file_index);
+    MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &checkpoint->file);
+
+    /* Until the new grid is in the file, it holds no valid checkpoint */
+    checkpoint->header[HEADER_MAGIC] = 0;
+    checkpoint->header[HEADER_N_ROWS] = tile->n_global_rows;
+    checkpoint->header[HEADER_N_COLUMNS] = tile->n_global_columns;
+    checkpoint->header[HEADER_STEP] = step;
+    if (rank == 0)
+    {
+        MPI_File_write_at(checkpoint->file, 0, checkpoint->header, HEADER_INTS, MPI_INT, MPI_STATUS_IGNORE);
+    }
+    set_tile_view(checkpoint->file, tile);
+    checkpoint->start_time = start_time;
+    checkpoint->in_flight = 1;
+    checkpoint->complete = 0;
+    if (blocking)
+    {
+        MPI_File_write_at_all(checkpoint->file, 0, checkpoint->buffer, tile->n_rows * tile->n_columns,
+                              MPI_DOUBLE, MPI_STATUS_IGNORE);
+        checkpoint->request = MPI_REQUEST_NULL;
+        checkpoint->complete = 1;
+        checkpoint->completion_time = MPI_Wtime();
+    }
+    else
+    {
+        MPI_File_iwrite_all(checkpoint->file, checkpoint->buffer, tile->n_rows * tile->n_columns,
+                            MPI_DOUBLE, &checkpoint->request);
+    }
+    checkpoint->blocked_time += MPI_Wtime() - start_time;
+}
+
+/* Let the write progress, and note when it has completed */
+void poll_checkpoint(struct checkpoint *checkpoint)
+{
+    if (checkpoint->in_flight && !checkpoint->complete)
+    {
+        MPI_Test(&checkpoint->request, &checkpoint->complete, MPI_STATUS_IGNORE);
+        if (checkpoint->complete)
+        {
+            checkpoint->completion_time = MPI_Wtime();
+        }
+    }
+}
+
+/* Wait for the write to complete, and then mark the file as holding a
+ * complete checkpoint */
+void finish_checkpoint(struct checkpoint *checkpoint, const struct tile *tile, MPI_Comm comm)
+{
+    if (!checkpoint->in_flight)
+    {
+        return;
+    }
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const double start_time = MPI_Wtime();
+    if (!checkpoint->complete)
+    {
+        MPI_Wait(&checkpoint->request, MPI_STATUS_IGNORE);
+        checkpoint->completion_time = MPI_Wtime();
+    }
+    MPI_File_sync(checkpoint->file);
+    MPI_File_set_view(checkpoint->file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+    if (rank == 0)
+    {
+        checkpoint->header[HEADER_MAGIC] = CHECKPOINT_MAGIC;
+        MPI_File_write_at(checkpoint->file, 0, checkpoint->header, HEADER_INTS, MPI_INT, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&checkpoint->file);
+    checkpoint->blocked_time += MPI_Wtime() - start_time;
+
+    checkpoint->in_flight = 0;
+    checkpoint->file_index = 1 - checkpoint->file_index;
+    checkpoint->n_written = checkpoint->n_written + 1;
+    checkpoint->bytes_written += sizeof(double) * (double)tile->n_global_rows * tile->n_global_columns;
+    checkpoint->write_time += checkpoint->completion_time - checkpoint->start_time;
+}
+
+/* Find the newest complete checkpoint with the given prefix. Returns
+ * its step, or -1 if there is none, and the name, index and header of
+ * its file. */
+int find_checkpoint(const char *prefix, char *file_name, size_t file_name_size, int *file_index,
+                    int header[HEADER_INTS], MPI_Comm comm)
+{
+    int newest_step = -1;
+    for (int k = 0; k < 2; k = k + 1)
+    {
+        char candidate_name[1024];
+        snprintf(candidate_name, sizeof(candidate_name), "%s-%d.chk", prefix, k);
+        MPI_File file;
+        if (MPI_File_open(comm, candidate_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        {
+            continue;
+        }
+        int candidate_header[HEADER_INTS];
+        MPI_File_read_at_all(file, 0, candidate_header, HEADER_INTS, MPI_INT, MPI_STATUS_IGNORE);
+        MPI_File_close(&file);
+        if (candidate_header[HEADER_MAGIC] == CHECKPOINT_MAGIC && candidate_header[HEADER_STEP] > newest_step)
+        {
+            newest_step = candidate_header[HEADER_STEP];
+            snprintf(file_name, file_name_size, "%s", candidate_name);
+            *file_index = k;
+            memcpy(header, candidate_header, sizeof(int) * HEADER_INTS);
+        }
+    }
+    return newest_step;
+}
+
+/* Read this rank's tile of the grid from a checkpoint file into the
+ * owned cells of data_set */
+void read_checkpoint(const char *file_name, const struct tile *tile, double *data_set, MPI_Comm comm)
+{
+    double *buffer = (double *)(malloc(sizeof(double) * tile->n_rows * tile->n_columns));
+    MPI_File file;
+    MPI_File_open(comm, file_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+    set_tile_view(file, tile);
+    MPI_File_read_all(file, buffer, tile->n_rows * tile->n_columns, MPI_DOUBLE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+    for (int i = 1; i <= tile->n_rows; i = i + 1)
+    {
+        memcpy(&data_set[INDEX(i, 1, tile->n_columns)], &buffer[(size_t)(i - 1) * tile->n_columns],
+               sizeof(double) * tile->n_columns);
+    }
+    free(buffer);
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment */
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* Read the global grid size and number of steps, how often to
+     * checkpoint, and where. With --restart, carry on from the newest
+     * checkpoint, which may have been written by a different number of
+     * ranks, up to the given number of steps. With --blocking, the
+     * steps wait for each checkpoint to be written. */
+    int n_global_rows = 512, n_global_columns = 512, max_step = 400;
+    int checkpoint_interval = 100, restart = 0, blocking = 0;
+    const char *prefix = "heat";
+    int n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--interval") == 0 && k + 1 < argc)
+        {
+            checkpoint_interval = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--prefix") == 0 && k + 1 < argc)
+        {
+            prefix = argv[k + 1];
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--restart") == 0)
+        {
+            restart = 1;
+        }
+        else if (strcmp(argv[k], "--blocking") == 0)
+        {
+            blocking = 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        n_global_columns = arguments[1];
+        max_step = arguments[2];
+    }
+    if ((n_arguments != 0 && n_arguments != 3) || checkpoint_interval < 1 || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--interval N] [--prefix name] "
+                            "[--restart] [--blocking]\n", argv[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* On restart, the grid size and first step come from the newest
+     * checkpoint */
+    int first_step = 0, restart_file_index = 1;
+    char restart_file_name[1024];
+    if (restart)
+    {
+        int header[HEADER_INTS];
+        const int step = find_checkpoint(prefix, restart_file_name, sizeof(restart_file_name),
+                                         &restart_file_index, header, MPI_COMM_WORLD);
+        if (step < 0)
+        {
+            if (rank == 0)
+            {
+                fprintf(stderr, "No complete checkpoint found at %s-0.chk or %s-1.chk\n", prefix, prefix);
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        n_global_rows = header[HEADER_N_ROWS];
+        n_global_columns = header[HEADER_N_COLUMNS];
+        first_step = step;
+    }
+
+    /* Arrange the ranks in a periodic 2D Cartesian grid, and find
+     * the neighbours in each direction */
+    int dims[2] = {0, 0}, periods[2] = {1, 1}, coords[2];
+    MPI_Dims_create(size, 2, dims);
+    MPI_Comm comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &comm);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Cart_coords(comm, rank, 2, coords);
+    int up_rank, down_rank, left_rank, right_rank;
+    MPI_Cart_shift(comm, 0, 1, &up_rank, &down_rank);
+    MPI_Cart_shift(comm, 1, 1, &left_rank, &right_rank);
+    if (n_global_rows < dims[0] || n_global_columns < dims[1])
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "A %d x %d grid can't be split over %d x %d ranks\n",
+                    n_global_rows, n_global_columns, dims[0], dims[1]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    struct tile tile;
+    tile.n_global_rows = n_global_rows;
+    tile.n_global_columns = n_global_columns;
+    decompose(n_global_rows, dims[0], coords[0], &tile.n_rows, &tile.row_offset);
+    decompose(n_global_columns, dims[1], coords[1], &tile.n_columns, &tile.column_offset);
+    const int n_rows = tile.n_rows, n_columns = tile.n_columns;
+
+    /* Prepare the initial values for this process, either from the
+     * global position of each cell, or from the checkpoint */
+    const size_t n_values = (size_t)(n_rows + 2) * (size_t)(n_columns + 2);
+    double *working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    double local_total = 0;
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const int global_i = tile.row_offset + i - 1;
+            const int global_j = tile.column_offset + j - 1;
+            local_total += (double)((global_i + 2 * global_j) % 7);
+            working_data_set[INDEX(i, j, n_columns)] = (double)((global_i + 2 * global_j) % 7);
+        }
+    }
+    double initial_total;
+    MPI_Allreduce(&local_total, &initial_total, 1, MPI_DOUBLE, MPI_SUM, comm);
+    if (restart)
+    {
+        read_checkpoint(restart_file_name, &tile, working_data_set, comm);
+        if (rank == 0)
+        {
+            printf("Restarted from %s after step %d on %d x %d ranks\n", restart_file_name, first_step,
+                   dims[0], dims[1]);
+        }
+    }
+
+    /* A column of the tile is described by a vector datatype */
+    MPI_Datatype column_type;
+    MPI_Type_vector(n_rows, 1, n_columns + 2, MPI_DOUBLE, &column_type);
+    MPI_Type_commit(&column_type);
+
+    struct checkpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.buffer = (double *)(malloc(sizeof(double) * n_rows * n_columns));
+    checkpoint.file_index = 1 - restart_file_index;
+
+    /* Do the loop over heat-propagation steps */
+    const int send_up_tag = 0, send_down_tag = 1, send_left_tag = 2, send_right_tag = 3;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = first_step; step < max_step; step = step + 1)
+    {
+        /* Exchange the halos */
+        MPI_Request requests[8];
+        MPI_Irecv(&working_data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Irecv(&working_data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_down_tag, comm, &requests[1]);
+        MPI_Irecv(&working_data_set[INDEX(1, n_columns + 1, n_columns)], 1, column_type,
+                  right_rank, send_left_tag, comm, &requests[2]);
+        MPI_Irecv(&working_data_set[INDEX(1, 0, n_columns)], 1, column_type,
+                  left_rank, send_right_tag, comm, &requests[3]);
+        MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_up_tag, comm, &requests[4]);
+        MPI_Isend(&working_data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_down_tag, comm, &requests[5]);
+        MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], 1, column_type,
+                  left_rank, send_left_tag, comm, &requests[6]);
+        MPI_Isend(&working_data_set[INDEX(1, n_columns, n_columns)], 1, column_type,
+                  right_rank, send_right_tag, comm, &requests[7]);
+
+        /* Do the local computation, which needs no halo data */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 2, n_columns - 1, n_columns, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(8, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation on the border of the tile */
+        compute_row(1, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        }
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 1, 1, n_columns, working_data_set, next_working_data_set);
+            if (n_columns > 1)
+            {
+                compute_row(i, n_columns, n_columns, n_columns, working_data_set, next_working_data_set);
+            }
+        }
+
+        /* Prepare to iterate by swapping the buffers */
+        double *temporary = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary;
+
+        /* Checkpoint the grid every so often. Only one checkpoint is in
+         * flight at a time, so the previous one must finish first. */
+        poll_checkpoint(&checkpoint);
+        if ((step + 1) % checkpoint_interval == 0 && step + 1 < max_step)
+        {
+            finish_checkpoint(&checkpoint, &tile, comm);
+            start_checkpoint(&checkpoint, prefix, step + 1, &tile, working_data_set, blocking, comm);
+        }
+    }
+
+    /* Always checkpoint the final grid, so a later run can carry on */
+    if (max_step > first_step)
+    {
+        finish_checkpoint(&checkpoint, &tile, comm);
+        start_checkpoint(&checkpoint, prefix, max_step, &tile, working_data_set, blocking, comm);
+        finish_checkpoint(&checkpoint, &tile, comm);
+    }
+    const double local_elapsed = MPI_Wtime() - start_time;
+
+    /* Check that the final checkpoint reads back exactly */
+    int local_success = 1, success;
+    if (max_step > first_step)
+    {
+        char file_name[1024];
+        int file_index, header[HEADER_INTS];
+        const int step = find_checkpoint(prefix, file_name, sizeof(file_name), &file_index, header, comm);
+        read_checkpoint(file_name, &tile, next_working_data_set, comm);
+        local_success = (step == max_step);
+        for (int i = 1; i <= n_rows; i = i + 1)
+        {
+            local_success = local_success && (memcmp(&next_working_data_set[INDEX(i, 1, n_columns)],
+                                                     &working_data_set[INDEX(i, 1, n_columns)],
+                                                     sizeof(double) * n_columns) == 0);
+        }
+    }
+    MPI_Allreduce(&local_success, &success, 1, MPI_INT, MPI_LAND, comm);
+
+    /* Report whether the total heat was conserved, and how fast the
+     * checkpoints were written */
+    double local_sums[2] = {0, 0}, sums[2];
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const double value = working_data_set[INDEX(i, j, n_columns)];
+            local_sums[0] += value;
+            local_sums[1] += value * value;
+        }
+    }
+    MPI_Reduce(local_sums, sums, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+    double local_times[3] = {local_elapsed, checkpoint.write_time, checkpoint.blocked_time}, times[3];
+    MPI_Reduce(local_times, times, 3, MPI_DOUBLE, MPI_MAX, 0, comm);
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d x %d ranks, steps %d to %d\n",
+               n_global_rows, n_global_columns, dims[0], dims[1], first_step, max_step);
+        printf("Sum of squares (compare across decompositions and restarts): %.12g\n", sums[1]);
+        printf("Wrote %d %s checkpoints of %g bytes in %g s of %g s, at %g bytes per second\n",
+               checkpoint.n_written, blocking ? "blocking" : "non-blocking",
+               (checkpoint.n_written > 0) ? checkpoint.bytes_written / checkpoint.n_written : 0.0,
+               times[1], times[0], (times[1] > 0) ? checkpoint.bytes_written / times[1] : 0.0);
+        printf("The steps were held up by checkpointing for %g s\n", times[2]);
+        if (success && fabs(sums[0] - initial_total) <= 1e-9 * fabs(initial_total))
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(checkpoint.buffer);
+    free(working_data_set);
+    free(next_working_data_set);
+    MPI_Type_free(&column_type);
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    return 0;
+}
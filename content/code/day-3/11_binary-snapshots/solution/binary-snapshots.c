@@ -0,0 +1,487 @@
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A snapshot file starts with a header of SNAPSHOT_HEADER_SIZE bytes,
+ * followed by one frame for every step that was written. A frame is
+ * the step number as a 64-bit integer, padded to FRAME_HEADER_SIZE
+ * bytes, followed by the whole grid as doubles in row-major order.
+ * snapshot-reader.c uses the same layout. */
+#define SNAPSHOT_HEADER_SIZE 64
+#define FRAME_HEADER_SIZE 16
+#define SNAPSHOT_MAGIC 0x50414e53
+#define SNAPSHOT_VERSION 1
+enum
+{
+    HEADER_MAGIC = 0,
+    HEADER_VERSION = 1,
+    HEADER_N_ROWS = 2,
+    HEADER_N_COLUMNS = 3,
+    HEADER_INTS = 4
+};
+
+/* Text output of every cell is only readable for tiny grids */
+#define MAX_PRINTED_SIZE 16
+
+/* Each rank owns a tile of n_rows x n_columns cells of the global
+ * grid.  The tile is stored on the heap with one ghost row above and
+ * below and one ghost column left and right, ie as
+ * (n_rows+2) x (n_columns+2) values in row-major order. */
+#define INDEX(i, j, n_columns) ((size_t)(i) * (size_t)((n_columns) + 2) + (size_t)(j))
+
+struct tile
+{
+    int n_global_rows, n_global_columns;
+    int n_rows, n_columns;
+    int row_offset, column_offset;
+};
+
+void compute_row(int row_index, int first_column, int last_column, int n_columns,
+                 const double *input, double *output)
+{
+    const size_t stride = (size_t)n_columns + 2;
+    for (int j = first_column; j <= last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat on the periodic domain is conserved */
+        const size_t center = INDEX(row_index, j, n_columns);
+        output[center] = 0.2 * (input[center] +
+                                input[center - 1] +
+                                input[center + 1] +
+                                input[center - stride] +
+                                input[center + stride]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* The output stage. The datatypes are made once: one picks the owned
+ * cells out of the tile in memory, so no copy is needed, and the other
+ * places them in the grid in the file. */
+struct snapshot_writer
+{
+    MPI_File file;
+    MPI_Datatype memory_type, file_type;
+    int n_frames;
+    double bytes_written, write_time;
+};
+
+void open_snapshots(struct snapshot_writer *writer, const char *file_name, const struct tile *tile,
+                    MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    MPI_File_open(comm, file_name, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &writer->file);
+    MPI_File_set_size(writer->file, 0);
+    if (rank == 0)
+    {
+        const int header[HEADER_INTS] = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, tile->n_global_rows,
+                                         tile->n_global_columns};
+        MPI_File_write_at(writer->file, 0, header, HEADER_INTS, MPI_INT, MPI_STATUS_IGNORE);
+    }
+
+    const int memory_sizes[2] = {tile->n_rows + 2, tile->n_columns + 2};
+    const int subsizes[2] = {tile->n_rows, tile->n_columns};
+    const int memory_starts[2] = {1, 1};
+    MPI_Type_create_subarray(2, memory_sizes, subsizes, memory_starts, MPI_ORDER_C, MPI_DOUBLE,
+                             &writer->memory_type);
+    MPI_Type_commit(&writer->memory_type);
+    const int file_sizes[2] = {tile->n_global_rows, tile->n_global_columns};
+    const int file_starts[2] = {tile->row_offset, tile->column_offset};
+    MPI_Type_create_subarray(2, file_sizes, subsizes, file_starts, MPI_ORDER_C, MPI_DOUBLE,
+                             &writer->file_type);
+    MPI_Type_commit(&writer->file_type);
+    writer->n_frames = 0;
+    writer->bytes_written = 0;
+    writer->write_time = 0;
+}
+
+/* Append the grid after the given step as a new frame. All ranks write
+ * their tiles with one collective call. */
+void write_snapshot(struct snapshot_writer *writer, const struct tile *tile, int step, const double *data_set,
+                    MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    const double start_time = MPI_Wtime();
+    const MPI_Offset grid_size = (MPI_Offset)sizeof(double) * tile->n_global_rows * tile->n_global_columns;
+    const MPI_Offset frame_offset = SNAPSHOT_HEADER_SIZE + writer->n_frames * (FRAME_HEADER_SIZE + grid_size);
+
+    /* The frame header is written in the plain view of bytes */
+    MPI_File_set_view(writer->file, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+    if (rank == 0)
+    {
+        const long long frame_step = step;
+        MPI_File_write_at(writer->file, frame_offset, &frame_step, 1, MPI_LONG_LONG, MPI_STATUS_IGNORE);
+    }
+    MPI_File_set_view(writer->file, frame_offset + FRAME_HEADER_SIZE, MPI_DOUBLE, writer->file_type,
+                      "native", MPI_INFO_NULL);
+    MPI_File_write_all(writer->file, data_set, 1, writer->memory_type, MPI_STATUS_IGNORE);
+
+    writer->n_frames = writer->n_frames + 1;
+    writer->bytes_written += FRAME_HEADER_SIZE + grid_size;
+    writer->write_time += MPI_Wtime() - start_time;
+}
+
+void close_snapshots(struct snapshot_writer *writer)
+{
+    MPI_File_close(&writer->file);
+    MPI_Type_free(&writer->memory_type);
+    MPI_Type_free(&writer->file_type);
+}
+
+/* Read the header and the last frame back from the file, and check
+ * that they match the grid in memory. Returns whether they all did. */
+int check_last_snapshot(const char *file_name, const struct tile *tile, int n_frames, int step,
+                        const double *data_set, MPI_Comm comm)
+{
+    MPI_File file;
+    MPI_File_open(comm, file_name, MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+    const MPI_Offset grid_size = (MPI_Offset)sizeof(double) * tile->n_global_rows * tile->n_global_columns;
+    const MPI_Offset frame_offset = SNAPSHOT_HEADER_SIZE + (MPI_Offset)(n_frames - 1) * (FRAME_HEADER_SIZE + grid_size);
+    int header[HEADER_INTS];
+    long long frame_step;
+    MPI_File_read_at_all(file, 0, header, HEADER_INTS, MPI_INT, MPI_STATUS_IGNORE);
+    MPI_File_read_at_all(file, frame_offset, &frame_step, 1, MPI_LONG_LONG, MPI_STATUS_IGNORE);
+
+    MPI_Datatype file_type;
+    const int file_sizes[2] = {tile->n_global_rows, tile->n_global_columns};
+    const int subsizes[2] = {tile->n_rows, tile->n_columns};
+    const int file_starts[2] = {tile->row_offset, tile->column_offset};
+    MPI_Type_create_subarray(2, file_sizes, subsizes, file_starts, MPI_ORDER_C, MPI_DOUBLE, &file_type);
+    MPI_Type_commit(&file_type);
+    MPI_File_set_view(file, frame_offset + FRAME_HEADER_SIZE, MPI_DOUBLE, file_type, "native", MPI_INFO_NULL);
+    const int n_cells = tile->n_rows * tile->n_columns;
+    double *read_data = (double *)(malloc(sizeof(double) * n_cells));
+    MPI_File_read_all(file, read_data, n_cells, MPI_DOUBLE, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+    MPI_Type_free(&file_type);
+
+    int local_success = (header[HEADER_MAGIC] == SNAPSHOT_MAGIC) && (header[HEADER_VERSION] == SNAPSHOT_VERSION) &&
+                        (header[HEADER_N_ROWS] == tile->n_global_rows) &&
+                        (header[HEADER_N_COLUMNS] == tile->n_global_columns) && (frame_step == step);
+    for (int i = 1; i <= tile->n_rows; i = i + 1)
+    {
+        local_success = local_success && (memcmp(&read_data[(i - 1) * tile->n_columns],
+                                                 &data_set[INDEX(i, 1, tile->n_columns)],
+                                                 sizeof(double) * tile->n_columns) == 0);
+    }
+    free(read_data);
+    int success;
+    MPI_Allreduce(&local_success, &success, 1, MPI_INT, MPI_LAND, comm);
+    return success;
+}
+
+/* For debugging on tiny grids, rank 0 collects the whole grid and
+ * prints it in order */
+void print_grid(const struct tile *tile, int step, const double *data_set, MPI_Comm comm)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int tag = 4;
+    int tile_layout[4] = {tile->n_rows, tile->n_columns, tile->row_offset, tile->column_offset};
+    if (rank != 0)
+    {
+        MPI_Datatype memory_type;
+        const int memory_sizes[2] = {tile->n_rows + 2, tile->n_columns + 2};
+        const int subsizes[2] = {tile->n_rows, tile->n_columns};
+        const int memory_starts[2] = {1, 1};
+        MPI_Type_create_subarray(2, memory_sizes, subsizes, memory_starts, MPI_ORDER_C, MPI_DOUBLE, &memory_type);
+        MPI_Type_commit(&memory_type);
+        MPI_Send(tile_layout, 4, MPI_INT, 0, tag, comm);
+        MPI_Send(data_set, 1, memory_type, 0, tag, comm);
+        MPI_Type_free(&memory_type);
+        return;
+    }
+
+    double *grid = (double *)(malloc(sizeof(double) * tile->n_global_rows * tile->n_global_columns));
+    for (int r = 0; r < size; r = r + 1)
+    {
+        if (r != 0)
+        {
+            MPI_Recv(tile_layout, 4, MPI_INT, r, tag, comm, MPI_STATUS_IGNORE);
+        }
+        const int sizes[2] = {tile->n_global_rows, tile->n_global_columns};
+        const int subsizes[2] = {tile_layout[0], tile_layout[1]};
+        const int starts[2] = {tile_layout[2], tile_layout[3]};
+        MPI_Datatype grid_type;
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_DOUBLE, &grid_type);
+        MPI_Type_commit(&grid_type);
+        if (r == 0)
+        {
+            for (int i = 1; i <= tile->n_rows; i = i + 1)
+            {
+                for (int j = 1; j <= tile->n_columns; j = j + 1)
+                {
+                    grid[(size_t)(tile->row_offset + i - 1) * tile->n_global_columns + tile->column_offset + j - 1] =
+                        data_set[INDEX(i, j, tile->n_columns)];
+                }
+            }
+        }
+        else
+        {
+            MPI_Recv(grid, 1, grid_type, r, tag, comm, MPI_STATUS_IGNORE);
+        }
+        MPI_Type_free(&grid_type);
+    }
+    printf("Grid after step %d:\n", step);
+    for (int i = 0; i < tile->n_global_rows; i = i + 1)
+    {
+        printf(" [ ");
+        for (int j = 0; j < tile->n_global_columns; j = j + 1)
+        {
+            if (j != 0)
+            {
+                printf(", ");
+            }
+            printf("%6.3f", grid[(size_t)i * tile->n_global_columns + j]);
+        }
+        printf(" ]\n");
+    }
+    free(grid);
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment */
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* Read the global grid size and number of steps, how often to
+     * write a snapshot, and where. The initial and final grids are
+     * always written. With --print, the same grids are also printed as
+     * text, which only makes sense for tiny grids. */
+    int n_global_rows = 512, n_global_columns = 512, max_step = 100;
+    int snapshot_interval = 10, print = 0;
+    const char *file_name = "heat.snap";
+    int n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--every") == 0 && k + 1 < argc)
+        {
+            snapshot_interval = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--output") == 0 && k + 1 < argc)
+        {
+            file_name = argv[k + 1];
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--print") == 0)
+        {
+            print = 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        n_global_columns = arguments[1];
+        max_step = arguments[2];
+    }
+    if ((n_arguments != 0 && n_arguments != 3) || snapshot_interval < 1 || max_step < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--every N] [--output file] [--print]\n",
+                    argv[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (print && (n_global_rows > MAX_PRINTED_SIZE || n_global_columns > MAX_PRINTED_SIZE))
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "--print is only for grids of up to %d x %d cells, use the snapshot reader instead\n",
+                    MAX_PRINTED_SIZE, MAX_PRINTED_SIZE);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* Arrange the ranks in a periodic 2D Cartesian grid, and find
+     * the neighbours in each direction */
+    int dims[2] = {0, 0}, periods[2] = {1, 1}, coords[2];
+    MPI_Dims_create(size, 2, dims);
+    MPI_Comm comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &comm);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Cart_coords(comm, rank, 2, coords);
+    int up_rank, down_rank, left_rank, right_rank;
+    MPI_Cart_shift(comm, 0, 1, &up_rank, &down_rank);
+    MPI_Cart_shift(comm, 1, 1, &left_rank, &right_rank);
+    if (n_global_rows < dims[0] || n_global_columns < dims[1])
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "A %d x %d grid can't be split over %d x %d ranks\n",
+                    n_global_rows, n_global_columns, dims[0], dims[1]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    struct tile tile;
+    tile.n_global_rows = n_global_rows;
+    tile.n_global_columns = n_global_columns;
+    decompose(n_global_rows, dims[0], coords[0], &tile.n_rows, &tile.row_offset);
+    decompose(n_global_columns, dims[1], coords[1], &tile.n_columns, &tile.column_offset);
+    const int n_rows = tile.n_rows, n_columns = tile.n_columns;
+
+    /* Prepare the initial values for this process. They depend only
+     * on the global position of each cell. */
+    const size_t n_values = (size_t)(n_rows + 2) * (size_t)(n_columns + 2);
+    double *working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    double *next_working_data_set = (double *)(calloc(n_values, sizeof(double)));
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const int global_i = tile.row_offset + i - 1;
+            const int global_j = tile.column_offset + j - 1;
+            working_data_set[INDEX(i, j, n_columns)] = (double)((global_i + 2 * global_j) % 7);
+        }
+    }
+
+    /* A column of the tile is described by a vector datatype */
+    MPI_Datatype column_type;
+    MPI_Type_vector(n_rows, 1, n_columns + 2, MPI_DOUBLE, &column_type);
+    MPI_Type_commit(&column_type);
+
+    struct snapshot_writer writer;
+    open_snapshots(&writer, file_name, &tile, comm);
+    write_snapshot(&writer, &tile, 0, working_data_set, comm);
+    const double initial_write_time = writer.write_time;
+    if (print)
+    {
+        print_grid(&tile, 0, working_data_set, comm);
+    }
+
+    /* Do the loop over heat-propagation steps */
+    const int send_up_tag = 0, send_down_tag = 1, send_left_tag = 2, send_right_tag = 3;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        /* Exchange the halos */
+        MPI_Request requests[8];
+        MPI_Irecv(&working_data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_up_tag, comm, &requests[0]);
+        MPI_Irecv(&working_data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_down_tag, comm, &requests[1]);
+        MPI_Irecv(&working_data_set[INDEX(1, n_columns + 1, n_columns)], 1, column_type,
+                  right_rank, send_left_tag, comm, &requests[2]);
+        MPI_Irecv(&working_data_set[INDEX(1, 0, n_columns)], 1, column_type,
+                  left_rank, send_right_tag, comm, &requests[3]);
+        MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  up_rank, send_up_tag, comm, &requests[4]);
+        MPI_Isend(&working_data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE,
+                  down_rank, send_down_tag, comm, &requests[5]);
+        MPI_Isend(&working_data_set[INDEX(1, 1, n_columns)], 1, column_type,
+                  left_rank, send_left_tag, comm, &requests[6]);
+        MPI_Isend(&working_data_set[INDEX(1, n_columns, n_columns)], 1, column_type,
+                  right_rank, send_right_tag, comm, &requests[7]);
+
+        /* Do the local computation, which needs no halo data */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 2, n_columns - 1, n_columns, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(8, requests, MPI_STATUSES_IGNORE);
+
+        /* Do the non-local computation on the border of the tile */
+        compute_row(1, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        }
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, 1, 1, n_columns, working_data_set, next_working_data_set);
+            if (n_columns > 1)
+            {
+                compute_row(i, n_columns, n_columns, n_columns, working_data_set, next_working_data_set);
+            }
+        }
+
+        /* Prepare to iterate by swapping the buffers */
+        double *temporary = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary;
+
+        /* Write the selected steps */
+        if ((step + 1) % snapshot_interval == 0 || step + 1 == max_step)
+        {
+            write_snapshot(&writer, &tile, step + 1, working_data_set, comm);
+            if (print)
+            {
+                print_grid(&tile, step + 1, working_data_set, comm);
+            }
+        }
+    }
+    const double local_elapsed = MPI_Wtime() - start_time;
+    close_snapshots(&writer);
+    const int success = check_last_snapshot(file_name, &tile, writer.n_frames, max_step, working_data_set, comm);
+
+    /* Report how fast the snapshots were written. The steps include
+     * every frame but the initial one, which was written before them. */
+    double local_times[2] = {initial_write_time + local_elapsed, writer.write_time}, times[2];
+    MPI_Reduce(local_times, times, 2, MPI_DOUBLE, MPI_MAX, 0, comm);
+    double local_sum_of_squares = 0, sum_of_squares;
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const double value = working_data_set[INDEX(i, j, n_columns)];
+            local_sum_of_squares += value * value;
+        }
+    }
+    MPI_Reduce(&local_sum_of_squares, &sum_of_squares, 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d x %d ranks, %d steps\n",
+               n_global_rows, n_global_columns, dims[0], dims[1], max_step);
+        printf("Sum of squares (compare across decompositions): %.12g\n", sum_of_squares);
+        printf("Wrote %d frames, %g bytes, to %s in %g s of %g s, at %g bytes per second\n", writer.n_frames,
+               writer.bytes_written, file_name, times[1], times[0],
+               (times[1] > 0) ? writer.bytes_written / times[1] : 0.0);
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(working_data_set);
+    free(next_working_data_set);
+    MPI_Type_free(&column_type);
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    return 0;
+}
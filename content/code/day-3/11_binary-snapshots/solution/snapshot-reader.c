@@ -0,0 +1,240 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Inspect the snapshot files written by binary-snapshots.c. This is a
+ * serial tool, and needs no MPI. The file is mapped into memory, so
+ * only the frames that are looked at are read from disk.
+ *
+ *   snapshot-reader file                    list the frames
+ *   snapshot-reader file frame              print one frame as text
+ *   snapshot-reader file frame file2 frame2 compare two frames
+ *
+ * The layout must match the one in binary-snapshots.c. */
+#define SNAPSHOT_HEADER_SIZE 64
+#define FRAME_HEADER_SIZE 16
+#define SNAPSHOT_MAGIC 0x50414e53
+#define SNAPSHOT_VERSION 1
+enum
+{
+    HEADER_MAGIC = 0,
+    HEADER_VERSION = 1,
+    HEADER_N_ROWS = 2,
+    HEADER_N_COLUMNS = 3
+};
+
+struct snapshot
+{
+    const char *file_name;
+    const unsigned char *data;
+    size_t file_size;
+    int n_rows, n_columns;
+    size_t frame_size;
+    long n_frames;
+};
+
+/* Map the file and check its header. Returns 0 on success. */
+int open_snapshot(const char *file_name, struct snapshot *snapshot)
+{
+    snapshot->file_name = file_name;
+    const int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(file_name);
+        return 1;
+    }
+    struct stat file_status;
+    if (fstat(fd, &file_status) != 0 || file_status.st_size < SNAPSHOT_HEADER_SIZE)
+    {
+        fprintf(stderr, "%s: too short to be a snapshot file\n", file_name);
+        close(fd);
+        return 1;
+    }
+    snapshot->file_size = (size_t)file_status.st_size;
+    void *mapping = mmap(NULL, snapshot->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror(file_name);
+        return 1;
+    }
+    snapshot->data = (const unsigned char *)(mapping);
+
+    int32_t header[4];
+    memcpy(header, snapshot->data, sizeof(header));
+    if (header[HEADER_MAGIC] != SNAPSHOT_MAGIC || header[HEADER_VERSION] != SNAPSHOT_VERSION ||
+        header[HEADER_N_ROWS] < 1 || header[HEADER_N_COLUMNS] < 1)
+    {
+        fprintf(stderr, "%s: not a snapshot file of version %d\n", file_name, SNAPSHOT_VERSION);
+        munmap(mapping, snapshot->file_size);
+        return 1;
+    }
+    snapshot->n_rows = header[HEADER_N_ROWS];
+    snapshot->n_columns = header[HEADER_N_COLUMNS];
+    snapshot->frame_size = FRAME_HEADER_SIZE + sizeof(double) * (size_t)snapshot->n_rows * snapshot->n_columns;
+
+    /* A frame that was only partly written, eg by a run that was
+     * killed, is ignored */
+    snapshot->n_frames = (long)((snapshot->file_size - SNAPSHOT_HEADER_SIZE) / snapshot->frame_size);
+    return 0;
+}
+
+void close_snapshot(struct snapshot *snapshot)
+{
+    munmap((void *)(snapshot->data), snapshot->file_size);
+}
+
+long long frame_step(const struct snapshot *snapshot, long frame)
+{
+    long long step;
+    memcpy(&step, snapshot->data + SNAPSHOT_HEADER_SIZE + frame * snapshot->frame_size, sizeof(step));
+    return step;
+}
+
+/* The grid of a frame. The mapping is page aligned and every frame
+ * starts at a multiple of 8 bytes, so it can be read in place. */
+const double *frame_grid(const struct snapshot *snapshot, long frame)
+{
+    return (const double *)(snapshot->data + SNAPSHOT_HEADER_SIZE + frame * snapshot->frame_size +
+                            FRAME_HEADER_SIZE);
+}
+
+int parse_frame(const struct snapshot *snapshot, const char *text, long *frame)
+{
+    char *end;
+    *frame = strtol(text, &end, 10);
+    if (*end != '\0' || *frame < 0 || *frame >= snapshot->n_frames)
+    {
+        fprintf(stderr, "%s: has frames 0 to %ld, not %s\n", snapshot->file_name, snapshot->n_frames - 1, text);
+        return 1;
+    }
+    return 0;
+}
+
+void list_frames(const struct snapshot *snapshot)
+{
+    const size_t n_cells = (size_t)snapshot->n_rows * snapshot->n_columns;
+    printf("%s: %d x %d grid, %ld frames\n", snapshot->file_name, snapshot->n_rows, snapshot->n_columns,
+           snapshot->n_frames);
+    printf("%8s %10s %14s %14s %14s\n", "frame", "step", "min", "max", "total");
+    for (long frame = 0; frame < snapshot->n_frames; frame = frame + 1)
+    {
+        const double *grid = frame_grid(snapshot, frame);
+        double min = grid[0], max = grid[0], total = 0;
+        for (size_t k = 0; k < n_cells; k = k + 1)
+        {
+            min = fmin(min, grid[k]);
+            max = fmax(max, grid[k]);
+            total += grid[k];
+        }
+        printf("%8ld %10lld %14.6g %14.6g %14.10g\n", frame, frame_step(snapshot, frame), min, max, total);
+    }
+}
+
+void print_frame(const struct snapshot *snapshot, long frame)
+{
+    const double *grid = frame_grid(snapshot, frame);
+    printf("Grid after step %lld:\n", frame_step(snapshot, frame));
+    for (int i = 0; i < snapshot->n_rows; i = i + 1)
+    {
+        printf(" [ ");
+        for (int j = 0; j < snapshot->n_columns; j = j + 1)
+        {
+            if (j != 0)
+            {
+                printf(", ");
+            }
+            printf("%6.3f", grid[(size_t)i * snapshot->n_columns + j]);
+        }
+        printf(" ]\n");
+    }
+}
+
+/* Report how many cells differ between two frames, and by how much.
+ * Returns whether the frames are identical. */
+int diff_frames(const struct snapshot *first, long first_frame, const struct snapshot *second, long second_frame)
+{
+    if (first->n_rows != second->n_rows || first->n_columns != second->n_columns)
+    {
+        printf("The grids differ in size: %d x %d and %d x %d\n", first->n_rows, first->n_columns,
+               second->n_rows, second->n_columns);
+        return 0;
+    }
+    const double *first_grid = frame_grid(first, first_frame);
+    const double *second_grid = frame_grid(second, second_frame);
+    size_t n_different = 0, worst_cell = 0;
+    double max_difference = 0;
+    for (size_t k = 0; k < (size_t)first->n_rows * first->n_columns; k = k + 1)
+    {
+        const double difference = fabs(first_grid[k] - second_grid[k]);
+        if (first_grid[k] != second_grid[k])
+        {
+            n_different = n_different + 1;
+        }
+        if (difference > max_difference)
+        {
+            max_difference = difference;
+            worst_cell = k;
+        }
+    }
+    printf("Step %lld of %s and step %lld of %s: %zu cells differ", frame_step(first, first_frame),
+           first->file_name, frame_step(second, second_frame), second->file_name, n_different);
+    if (n_different > 0)
+    {
+        printf(", by up to %g at row %zu, column %zu", max_difference, worst_cell / first->n_columns,
+               worst_cell % first->n_columns);
+    }
+    printf("\n");
+    return n_different == 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 && argc != 3 && argc != 5)
+    {
+        fprintf(stderr, "Usage: %s file [frame [file2 frame2]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct snapshot first, second;
+    if (open_snapshot(argv[1], &first) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    long first_frame, second_frame;
+    if (argc == 2)
+    {
+        list_frames(&first);
+    }
+    else if (parse_frame(&first, argv[2], &first_frame) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    else if (argc == 3)
+    {
+        print_frame(&first, first_frame);
+    }
+    else if (open_snapshot(argv[3], &second) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    else
+    {
+        /* Like diff, exit with failure when the frames differ */
+        if (parse_frame(&second, argv[4], &second_frame) != 0 ||
+            !diff_frames(&first, first_frame, &second, second_frame))
+        {
+            status = EXIT_FAILURE;
+        }
+        close_snapshot(&second);
+    }
+    close_snapshot(&first);
+    return status;
+}
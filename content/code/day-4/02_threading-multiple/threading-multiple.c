@@ -74,7 +74,11 @@ int main(int argc, char **argv)
         }
         printf(" ]\n");
     }
-    float working_data_set[6][8];
+    /* Each step reads one of these buffers and writes the other, and
+     * then they swap roles, so no copy is needed between steps */
+    float data_sets[2][6][8];
+    float (*working_data_set)[8] = data_sets[0];
+    float (*next_working_data_set)[8] = data_sets[1];
     for (int i = 0; i < 4; i = i + 1)
     {
         for (int j = 0; j < 8; j = j + 1)
@@ -88,7 +92,6 @@ int main(int argc, char **argv)
     int success = 1;
 
     /* Do the loop over heat-propagation steps */
-    float next_working_data_set[6][8];
     float total, local_total, temporary_total;
     const int total_root_rank = 0;
     MPI_Request total_request = MPI_REQUEST_NULL;
@@ -212,15 +215,11 @@ int main(int argc, char **argv)
         MPI_Wait(&sent_to_destination[0], MPI_STATUS_IGNORE);
         MPI_Wait(&sent_to_destination[1], MPI_STATUS_IGNORE);
 
-        /* Prepare to iterate */
-        for (int i = 1; i < 5; i = i + 1)
-        {
-            for (int j = 0; j < 8; j = j + 1)
-            {
-                /* copy the output back to the input array */
-                working_data_set[i][j] = next_working_data_set[i][j];
-            }
-        }
+        /* Prepare to iterate by swapping the buffers. The halo
+         * receives of the next step then target the new input. */
+        float (*temporary_data_set)[8] = working_data_set;
+        working_data_set = next_working_data_set;
+        next_working_data_set = temporary_data_set;
     }
     /* Now that we have left the main loop, we should wait for
      * the most recent total heat reduction to complete. */
@@ -0,0 +1,207 @@
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Columns are processed in blocks of this many values, so that the
+ * three input rows a block needs stay in cache from one row to the
+ * next, even when the rows are too wide to fit. */
+#define BLOCK_WIDTH 2048
+
+/* Rows are stored contiguously, width values each, and the columns are
+ * periodic, just like in the other stencil exercises. */
+void compute_row(int row_index, int width, const float *input, float *output)
+{
+    for (int j = 0; j < width; j = j + 1)
+    {
+        /* Here is the 5-point stencil */
+        const int right_column_index = (j + 1) % width;
+        const int left_column_index = (j + width - 1) % width;
+        const int top_row_index = row_index-1;
+        const int bottom_row_index = row_index+1;
+        output[row_index * width + j] = (input[row_index * width + j] +
+                                         input[row_index * width + left_column_index] +
+                                         input[row_index * width + right_column_index] +
+                                         input[top_row_index * width + j] +
+                                         input[bottom_row_index * width + j]);
+    }
+}
+
+/* Compute the columns first_column to last_column - 1 of a row, none of
+ * which may be the first or last column of the grid, so no wrap-around
+ * is needed and the loop vectorizes. */
+void compute_row_interior(const float *restrict top_row, const float *restrict this_row,
+                          const float *restrict bottom_row, float *restrict output_row,
+                          int first_column, int last_column)
+{
+#pragma omp simd
+    for (int j = first_column; j < last_column; j = j + 1)
+    {
+        output_row[j] = (this_row[j] +
+                         this_row[j - 1] +
+                         this_row[j + 1] +
+                         top_row[j] +
+                         bottom_row[j]);
+    }
+}
+
+/* Compute rows first_row to last_row - 1, one block of columns at a
+ * time. The periodic wrap-around columns 0 and width - 1 are peeled out
+ * of the loop, and computed in the same order as compute_row() does so
+ * that both kernels give bitwise identical results. */
+void compute_rows_blocked(int first_row, int last_row, int width,
+                          const float *input, float *output)
+{
+    for (int block_start = 0; block_start < width; block_start = block_start + BLOCK_WIDTH)
+    {
+        const int block_end = (block_start + BLOCK_WIDTH < width) ? block_start + BLOCK_WIDTH : width;
+        const int first_column = (block_start == 0) ? 1 : block_start;
+        const int last_column = (block_end == width) ? width - 1 : block_end;
+        for (int i = first_row; i < last_row; i = i + 1)
+        {
+            const float *top_row = input + (size_t)(i - 1) * width;
+            const float *this_row = input + (size_t)i * width;
+            const float *bottom_row = input + (size_t)(i + 1) * width;
+            float *output_row = output + (size_t)i * width;
+            if (block_start == 0)
+            {
+                output_row[0] = (this_row[0] +
+                                 this_row[width - 1] +
+                                 this_row[(width > 1) ? 1 : 0] +
+                                 top_row[0] +
+                                 bottom_row[0]);
+            }
+            compute_row_interior(top_row, this_row, bottom_row, output_row,
+                                 first_column, last_column);
+            if (block_end == width && width > 1)
+            {
+                output_row[width - 1] = (this_row[width - 1] +
+                                         this_row[width - 2] +
+                                         this_row[0] +
+                                         top_row[width - 1] +
+                                         bottom_row[width - 1]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* Every rank benchmarks the kernels independently on its own data,
+     * which shows the per-core throughput when all cores are busy */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Each benchmark updates about this many cells per repetition */
+    int n_cells = 1 << 22;
+    if (argc > 1)
+    {
+        n_cells = atoi(argv[1]);
+    }
+    const int widths[] = {8, 64, 512, 4096, 32768, 262144, 1048576};
+    const int n_widths = sizeof(widths) / sizeof(widths[0]);
+    const double min_time = 0.2;
+
+    /* A stencil update does 4 additions, and at best reads the input
+     * and writes the output once, plus the write-allocate of the
+     * output cache line. */
+    const double flops_per_cell = 4;
+    const double bytes_per_cell = 3 * sizeof(float);
+
+    if (rank == 0)
+    {
+        printf("Stencil kernels on %d ranks, %d bytes per cell moved at best\n",
+               size, (int)bytes_per_cell);
+        printf("%10s %8s %14s %14s %14s %14s\n", "width", "rows",
+               "old GFLOP/s", "old GB/s", "new GFLOP/s", "new GB/s");
+    }
+    int success = 1;
+    for (int w = 0; w < n_widths; w = w + 1)
+    {
+        const int width = widths[w];
+        int n_rows = n_cells / width;
+        if (n_rows < 4)
+        {
+            n_rows = 4;
+        }
+        /* Allocate one ghost row above and below */
+        const size_t n_values = (size_t)(n_rows + 2) * width;
+        float *input = (float *)(malloc(sizeof(float) * n_values));
+        float *old_output = (float *)(calloc(n_values, sizeof(float)));
+        float *new_output = (float *)(calloc(n_values, sizeof(float)));
+        for (size_t k = 0; k < n_values; k = k + 1)
+        {
+            input[k] = (float)((k * 7 + rank) % 13);
+        }
+
+        /* Time each kernel, repeating until enough time has passed to
+         * give a stable measurement */
+        double gflops[2], bandwidth[2];
+        for (int kernel = 0; kernel < 2; kernel = kernel + 1)
+        {
+            int n_repeats = 0;
+            double elapsed = 0;
+            MPI_Barrier(comm);
+            const double start_time = MPI_Wtime();
+            while (elapsed < min_time)
+            {
+                if (kernel == 0)
+                {
+                    for (int i = 1; i <= n_rows; i = i + 1)
+                    {
+                        compute_row(i, width, input, old_output);
+                    }
+                }
+                else
+                {
+                    compute_rows_blocked(1, n_rows + 1, width, input, new_output);
+                }
+                n_repeats = n_repeats + 1;
+                elapsed = MPI_Wtime() - start_time;
+            }
+            const double cells_per_second = (double)n_rows * width * n_repeats / elapsed;
+            double local_rates[2] = {cells_per_second * flops_per_cell * 1e-9,
+                                     cells_per_second * bytes_per_cell * 1e-9};
+            double rates[2];
+            MPI_Reduce(local_rates, rates, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+            gflops[kernel] = rates[0] / size;
+            bandwidth[kernel] = rates[1] / size;
+        }
+
+        /* Check that the new kernel gives the same answer */
+        for (size_t k = width; k < n_values - width; k = k + 1)
+        {
+            success = success && (old_output[k] == new_output[k]);
+        }
+        if (rank == 0)
+        {
+            printf("%10d %8d %14.3f %14.3f %14.3f %14.3f\n", width, n_rows,
+                   gflops[0], bandwidth[0], gflops[1], bandwidth[1]);
+        }
+        free(input);
+        free(old_output);
+        free(new_output);
+    }
+
+    /* Report whether the code is correct */
+    int all_success;
+    MPI_Reduce(&success, &all_success, 1, MPI_INT, MPI_LAND, 0, comm);
+    if (rank == 0)
+    {
+        printf("GFLOP/s and GB/s are averages per rank\n");
+        if (all_success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Finalize();
+    return 0;
+}
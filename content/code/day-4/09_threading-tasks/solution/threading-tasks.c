@@ -0,0 +1,464 @@
+#include <omp.h>
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    /* Here is the 5-point stencil, scaled by 1/5 so that the total heat
+     * is conserved. The periodic wrap-around columns are peeled out of
+     * the loop over the other columns. */
+    output_row[0] = 0.2 * (this_row[0] + this_row[width - 1] + this_row[1 % width] +
+                           top_row[0] + bottom_row[0]);
+    for (int j = 1; j < width - 1; j = j + 1)
+    {
+        output_row[j] = 0.2 * (this_row[j] + this_row[j - 1] + this_row[j + 1] +
+                               top_row[j] + bottom_row[j]);
+    }
+    if (width > 1)
+    {
+        output_row[width - 1] = 0.2 * (this_row[width - 1] + this_row[width - 2] + this_row[0] +
+                                       top_row[width - 1] + bottom_row[width - 1]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* A halo message in flight. The task that posted it is detached, so
+ * it only completes, and releases the tasks that depend on it, once
+ * the thread polling the slots sees the message complete and fulfills
+ * its event. */
+struct halo_slot
+{
+    MPI_Request request;
+    omp_event_handle_t event;
+    int active;
+};
+
+void activate_slot(struct halo_slot *slot, MPI_Request request, omp_event_handle_t event)
+{
+#pragma omp critical (halo_slots)
+    {
+        slot->request = request;
+        slot->event = event;
+        slot->active = 1;
+    }
+}
+
+/* Test each active message once, and return how many completed */
+int poll_slots(struct halo_slot *slots, int n_slots)
+{
+    int n_completed = 0;
+    for (int k = 0; k < n_slots; k = k + 1)
+    {
+        int active;
+#pragma omp critical (halo_slots)
+        active = slots[k].active;
+        if (active)
+        {
+            int done;
+            MPI_Test(&slots[k].request, &done, MPI_STATUS_IGNORE);
+            if (done)
+            {
+#pragma omp critical (halo_slots)
+                slots[k].active = 0;
+                omp_fulfill_event(slots[k].event);
+                n_completed = n_completed + 1;
+            }
+        }
+    }
+    return n_completed;
+}
+
+/* The reference: the main thread does all the communication, and the
+ * threads join in on the computation in between, as in the
+ * MPI_THREAD_FUNNELED exercise. */
+void run_funneled(int max_step, int n_rows, int width, double *data_sets[2],
+                  int up_rank, int down_rank, MPI_Comm comm)
+{
+    const int send_up_tag = 0, send_down_tag = 1;
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        double *working_data_set = data_sets[step % 2];
+        double *next_working_data_set = data_sets[1 - step % 2];
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation */
+#pragma omp parallel for
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+        /* Implied thread barrier here */
+
+        /* Wait for the halo-exchange receives, and do the non-local
+         * computation */
+        MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+        compute_row(1, width, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, width, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(2, &requests[2], MPI_STATUSES_IGNORE);
+    }
+}
+
+/* One parallel region for all the steps. The rows are split into
+ * blocks, and each block of each step is a task that depends only on
+ * the three blocks of the previous step it reads, so a block can start
+ * as soon as they are done, regardless of the rest of the grid. The
+ * halo messages are tasks too. A block that reads a ghost row depends
+ * on the task that receives that row, which completes when that
+ * receive is seen to complete.
+ *
+ * Once too many tasks are queued, a runtime may run each new task at
+ * once in the thread creating it, eg libgomp does beyond 64 per thread.
+ * A message task run that way waits for its message, which may only be
+ * matched by a task not created yet, so the run would hang. So before
+ * creating the tasks of a step, the creating thread polls the messages
+ * until the blocks of two steps ago are done, and limit_block_rows
+ * keeps a step to a few tasks per thread, so that no more than about
+ * two steps of tasks are ever queued.
+ *
+ * Messages travelling up use comms[0] and those travelling down use
+ * comms[1]. These can be the same communicator, or one each, so that
+ * the threads sending in each direction don't contend for the same
+ * communicator inside the MPI library. */
+#define MAX_TASKS_PER_THREAD 16
+
+/* The rows per block, at least block_rows, that keep the tasks of a
+ * step, ie the blocks and 4 messages, to MAX_TASKS_PER_THREAD per
+ * thread */
+int limit_block_rows(int n_rows, int block_rows, int n_threads)
+{
+    const int max_blocks = MAX_TASKS_PER_THREAD * n_threads - 4;
+    if ((n_rows + block_rows - 1) / block_rows > max_blocks)
+    {
+        block_rows = (n_rows + max_blocks - 1) / max_blocks;
+    }
+    return block_rows;
+}
+
+void run_tasks(int max_step, int n_rows, int width, int block_rows, double *data_sets[2],
+               int up_rank, int down_rank, MPI_Comm comms[2])
+{
+    block_rows = limit_block_rows(n_rows, block_rows, omp_get_max_threads());
+    const int n_blocks = (n_rows + block_rows - 1) / block_rows;
+
+    /* These are only used to name the dependencies between tasks:
+     * the blocks and the two ghost rows of each of the two buffers */
+    char *block_tokens[2], *ghost_tokens[2];
+    block_tokens[0] = (char *)(malloc(n_blocks));
+    block_tokens[1] = (char *)(malloc(n_blocks));
+    ghost_tokens[0] = (char *)(malloc(2));
+    ghost_tokens[1] = (char *)(malloc(2));
+
+    /* One message slot for each buffer, direction and receive or send */
+    struct halo_slot slots[2][2][2];
+    for (int k = 0; k < 8; k = k + 1)
+    {
+        (&slots[0][0][0])[k].active = 0;
+    }
+    /* How many blocks of the last step to write each buffer are done */
+    int blocks_done[2] = {0, 0};
+
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            int n_completed = 0;
+            for (int step = 0; step < max_step; step = step + 1)
+            {
+                const int p = step % 2;
+                double *working_data_set = data_sets[p];
+                double *next_working_data_set = data_sets[1 - p];
+                /* Messages of consecutive steps can be in flight at the
+                 * same time, so they are told apart by the tag */
+                const int send_up_tag = 2 * p, send_down_tag = 2 * p + 1;
+                omp_event_handle_t event;
+
+                /* Keep the messages moving until the blocks of two steps
+                 * ago, which wrote the same buffer as this step, are done */
+                if (step >= 2)
+                {
+                    int n_done;
+                    do
+                    {
+                        n_completed = n_completed + poll_slots(&slots[0][0][0], 8);
+#pragma omp atomic read
+                        n_done = blocks_done[1 - p];
+                    } while (n_done < n_blocks);
+#pragma omp atomic write
+                    blocks_done[1 - p] = 0;
+                }
+
+                /* Receive the ghost rows, once the tasks of two steps
+                 * ago are done reading them */
+#pragma omp task depend(out: ghost_tokens[p][0]) detach(event)
+                {
+                    MPI_Request request;
+                    MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                              send_down_tag, comms[1], &request);
+                    activate_slot(&slots[p][0][0], request, event);
+                }
+#pragma omp task depend(out: ghost_tokens[p][1]) detach(event)
+                {
+                    MPI_Request request;
+                    MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                              send_up_tag, comms[0], &request);
+                    activate_slot(&slots[p][1][0], request, event);
+                }
+
+                /* Send the border rows as soon as they are computed. The
+                 * tasks only complete when the sends do, so the next
+                 * step can't overwrite the rows before that. */
+#pragma omp task depend(in: block_tokens[p][0]) detach(event)
+                {
+                    MPI_Request request;
+                    MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                              send_up_tag, comms[0], &request);
+                    activate_slot(&slots[p][0][1], request, event);
+                }
+#pragma omp task depend(in: block_tokens[p][n_blocks - 1]) detach(event)
+                {
+                    MPI_Request request;
+                    MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                              send_down_tag, comms[1], &request);
+                    activate_slot(&slots[p][1][1], request, event);
+                }
+
+                /* Compute the blocks */
+                for (int b = 0; b < n_blocks; b = b + 1)
+                {
+                    const int first_row = 1 + b * block_rows;
+                    const int last_row = (first_row + block_rows - 1 < n_rows) ? first_row + block_rows - 1 : n_rows;
+                    const int above = (b > 0) ? b - 1 : b;
+                    const int below = (b < n_blocks - 1) ? b + 1 : b;
+                    if (b == 0 || b == n_blocks - 1)
+                    {
+                        const int top_ghost = (b == 0) ? 0 : 1;
+                        const int bottom_ghost = (b == n_blocks - 1) ? 1 : 0;
+#pragma omp task depend(in: block_tokens[p][above], block_tokens[p][b], block_tokens[p][below]) \
+                 depend(in: ghost_tokens[p][top_ghost], ghost_tokens[p][bottom_ghost]) \
+                 depend(out: block_tokens[1 - p][b])
+                        {
+                            for (int i = first_row; i <= last_row; i = i + 1)
+                            {
+                                compute_row(i, width, working_data_set, next_working_data_set);
+                            }
+#pragma omp atomic update
+                            blocks_done[1 - p] = blocks_done[1 - p] + 1;
+                        }
+                    }
+                    else
+                    {
+#pragma omp task depend(in: block_tokens[p][above], block_tokens[p][b], block_tokens[p][below]) \
+                 depend(out: block_tokens[1 - p][b])
+                        {
+                            for (int i = first_row; i <= last_row; i = i + 1)
+                            {
+                                compute_row(i, width, working_data_set, next_working_data_set);
+                            }
+#pragma omp atomic update
+                            blocks_done[1 - p] = blocks_done[1 - p] + 1;
+                        }
+                    }
+                }
+
+                n_completed = n_completed + poll_slots(&slots[0][0][0], 8);
+            }
+
+            /* Keep the messages moving until all of them are done, while
+             * the other threads run the tasks */
+            while (n_completed < 4 * max_step)
+            {
+                n_completed = n_completed + poll_slots(&slots[0][0][0], 8);
+            }
+        }
+    }
+    /* End thread-parallel region */
+
+    free(block_tokens[0]);
+    free(block_tokens[1]);
+    free(ghost_tokens[0]);
+    free(ghost_tokens[1]);
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment and check */
+    int provided, required = MPI_THREAD_MULTIPLE;
+    MPI_Init_thread(&argc, &argv, required, &provided);
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    /* If the program can't run, stop running */
+    if (required != provided)
+    {
+        printf("Sorry, the MPI library does not provide "
+               "this threading level! Aborting!\n");
+        MPI_Abort(comm, 1);
+    }
+
+    /* The ranks form a ring */
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+
+    int n_global_rows = 2048, width = 2048, max_step = 100, block_rows = 16;
+    if (argc > 1 && argc != 4 && argc != 5)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps [block_rows]]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    if (argc >= 4)
+    {
+        n_global_rows = atoi(argv[1]);
+        width = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+    }
+    if (argc == 5)
+    {
+        block_rows = atoi(argv[4]);
+    }
+    if (n_global_rows < size || block_rows < 1)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Every rank needs at least one row, and blocks at least one row\n");
+        }
+        MPI_Abort(comm, 1);
+    }
+    /* One thread keeps the messages moving while the others compute */
+    const int n_threads = omp_get_max_threads();
+    if (n_threads < 2)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "The task version needs at least 2 threads, please set OMP_NUM_THREADS\n");
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+    const size_t n_values = (size_t)(n_rows + 2) * width;
+    double *data_sets[2];
+    data_sets[0] = (double *)(malloc(sizeof(double) * n_values));
+    data_sets[1] = (double *)(malloc(sizeof(double) * n_values));
+
+    /* Make a communicator for each direction of the halo messages. The
+     * hints promise that receives never use wildcards, which lets the
+     * library match messages more cheaply. They were standardized in
+     * MPI 4.0, and older libraries ignore them. */
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "mpi_assert_no_any_source", "true");
+    MPI_Info_set(info, "mpi_assert_no_any_tag", "true");
+    MPI_Comm shared_comms[2] = {comm, comm}, direction_comms[2];
+    MPI_Comm_dup_with_info(comm, info, &direction_comms[0]);
+    MPI_Comm_dup_with_info(comm, info, &direction_comms[1]);
+    MPI_Info_free(&info);
+
+    /* Run all versions from the same initial values */
+    const char *version_names[] = {"funneled", "tasks, shared communicator",
+                                   "tasks, communicator per direction"};
+    double elapsed[3], sum_of_squares[3];
+    for (int version = 0; version < 3; version = version + 1)
+    {
+        for (size_t k = 0; k < n_values; k = k + 1)
+        {
+            data_sets[0][k] = data_sets[1][k] = 0;
+        }
+        for (int i = 1; i <= n_rows; i = i + 1)
+        {
+            for (int j = 0; j < width; j = j + 1)
+            {
+                row(data_sets[0], i, width)[j] = (double)((row_offset + i - 1 + 2 * j) % 7);
+            }
+        }
+
+        MPI_Barrier(comm);
+        const double start_time = MPI_Wtime();
+        if (version == 0)
+        {
+            run_funneled(max_step, n_rows, width, data_sets, up_rank, down_rank, comm);
+        }
+        else
+        {
+            run_tasks(max_step, n_rows, width, block_rows, data_sets, up_rank, down_rank,
+                      (version == 1) ? shared_comms : direction_comms);
+        }
+        const double local_elapsed = MPI_Wtime() - start_time;
+        MPI_Reduce(&local_elapsed, &elapsed[version], 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+        double local_sum = 0;
+        for (int i = 1; i <= n_rows; i = i + 1)
+        {
+            for (int j = 0; j < width; j = j + 1)
+            {
+                const double value = row(data_sets[max_step % 2], i, width)[j];
+                local_sum += value * value;
+            }
+        }
+        MPI_Reduce(&local_sum, &sum_of_squares[version], 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    }
+
+    /* Report whether the code is correct, and how fast */
+    if (rank == 0)
+    {
+        printf("Grid of %d x %d cells on %d ranks with %d threads, %d steps, tasks of %d rows on rank 0\n",
+               n_global_rows, width, size, n_threads, max_step, limit_block_rows(n_rows, block_rows, n_threads));
+        for (int version = 0; version < 3; version = version + 1)
+        {
+            printf("%-34s %12.6f s, speedup over funneled %.2f\n", version_names[version],
+                   elapsed[version], elapsed[0] / elapsed[version]);
+        }
+        if (sum_of_squares[0] == sum_of_squares[1] && sum_of_squares[0] == sum_of_squares[2])
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(data_sets[0]);
+    free(data_sets[1]);
+    MPI_Comm_free(&direction_comms[0]);
+    MPI_Comm_free(&direction_comms[1]);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <omp.h>
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Every thread of a rank exchanges a window of small messages with the
+ * same thread on a partner rank, over and over. Either all threads use
+ * one communicator and tell their messages apart by tag, or each
+ * thread uses a communicator of its own. Returns the number of
+ * messages this rank sent and received per second. */
+double measure_message_rate(int n_threads, int n_iterations, int window_size, int message_size,
+                            int partner_rank, MPI_Comm *thread_comms, int per_thread)
+{
+    MPI_Barrier(thread_comms[0]);
+    const double start_time = MPI_Wtime();
+#pragma omp parallel num_threads(n_threads)
+    {
+        /* Thread k talks to thread k of the partner, so a smaller team
+         * than asked for would leave messages unmatched */
+        if (omp_get_num_threads() != n_threads)
+        {
+            printf("Asked for %d threads, but got %d! Aborting!\n", n_threads, omp_get_num_threads());
+            MPI_Abort(thread_comms[0], 1);
+        }
+        const int thread = omp_get_thread_num();
+        const MPI_Comm comm = per_thread ? thread_comms[thread] : thread_comms[0];
+        const int tag = per_thread ? 0 : thread;
+        char *send_buffer = (char *)(calloc((size_t)window_size * message_size, 1));
+        char *recv_buffer = (char *)(calloc((size_t)window_size * message_size, 1));
+        MPI_Request *requests = (MPI_Request *)(malloc(sizeof(MPI_Request) * 2 * window_size));
+        for (int iteration = 0; iteration < n_iterations; iteration = iteration + 1)
+        {
+            for (int k = 0; k < window_size; k = k + 1)
+            {
+                MPI_Irecv(recv_buffer + (size_t)k * message_size, message_size, MPI_BYTE,
+                          partner_rank, tag, comm, &requests[k]);
+            }
+            for (int k = 0; k < window_size; k = k + 1)
+            {
+                MPI_Isend(send_buffer + (size_t)k * message_size, message_size, MPI_BYTE,
+                          partner_rank, tag, comm, &requests[window_size + k]);
+            }
+            MPI_Waitall(2 * window_size, requests, MPI_STATUSES_IGNORE);
+        }
+        free(send_buffer);
+        free(recv_buffer);
+        free(requests);
+    }
+    /* End thread-parallel region */
+    const double elapsed = MPI_Wtime() - start_time;
+    return 2.0 * n_threads * window_size * n_iterations / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment and check */
+    int provided, required = MPI_THREAD_MULTIPLE;
+    MPI_Init_thread(&argc, &argv, required, &provided);
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    /* If the program can't run, stop running */
+    if (required != provided)
+    {
+        printf("Sorry, the MPI library does not provide "
+               "this threading level! Aborting!\n");
+        MPI_Abort(comm, 1);
+    }
+
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    if (size % 2 != 0)
+    {
+        if (rank == 0)
+        {
+            printf("Ranks are paired up, please re-run with an even number of ranks\n");
+        }
+        MPI_Finalize();
+        return 0;
+    }
+    const int partner_rank = rank ^ 1;
+
+    int n_iterations = 1000, window_size = 64;
+    if (argc > 1)
+    {
+        n_iterations = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        window_size = atoi(argv[2]);
+    }
+
+    /* Make a communicator for each thread. The hints promise that
+     * receives never use wildcards, so that the library can give each
+     * communicator its own matching queue, and possibly its own network
+     * endpoint. They were standardized in MPI 4.0, and older libraries
+     * ignore them. Dynamic adjustment is turned off, so that every
+     * parallel region gets this many threads, or fails loudly. */
+    omp_set_dynamic(0);
+    const int n_threads = omp_get_max_threads();
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "mpi_assert_no_any_source", "true");
+    MPI_Info_set(info, "mpi_assert_no_any_tag", "true");
+    MPI_Comm *thread_comms = (MPI_Comm *)(malloc(sizeof(MPI_Comm) * n_threads));
+    for (int thread = 0; thread < n_threads; thread = thread + 1)
+    {
+        MPI_Comm_dup_with_info(comm, info, &thread_comms[thread]);
+    }
+    MPI_Info_free(&info);
+    MPI_Comm shared_comm = comm;
+
+    /* Measure both ways for a few message sizes */
+    const int message_sizes[] = {8, 64, 1024, 16384};
+    const int n_message_sizes = sizeof(message_sizes) / sizeof(message_sizes[0]);
+    if (rank == 0)
+    {
+        printf("Message rate with %d threads on each of %d ranks, window of %d messages\n",
+               n_threads, size, window_size);
+        printf("%10s %24s %24s %8s\n", "bytes", "shared (msg/s/rank)", "per-thread (msg/s/rank)", "ratio");
+    }
+    for (int m = 0; m < n_message_sizes; m = m + 1)
+    {
+        double local_rates[2], rates[2];
+        local_rates[0] = measure_message_rate(n_threads, n_iterations, window_size, message_sizes[m],
+                                              partner_rank, &shared_comm, 0);
+        local_rates[1] = measure_message_rate(n_threads, n_iterations, window_size, message_sizes[m],
+                                              partner_rank, thread_comms, 1);
+        MPI_Reduce(local_rates, rates, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+        if (rank == 0)
+        {
+            printf("%10d %24.4g %24.4g %8.2f\n", message_sizes[m],
+                   rates[0] / size, rates[1] / size, rates[1] / rates[0]);
+        }
+    }
+
+    /* Clean up and exit */
+    for (int thread = 0; thread < n_threads; thread = thread + 1)
+    {
+        MPI_Comm_free(&thread_comms[thread]);
+    }
+    free(thread_comms);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,399 @@
+#include <omp.h>
+#include "mpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Partitioned point-to-point communication arrived in MPI 4.0. Without
+ * it, the border rows are sent whole by the main thread, using
+ * ordinary persistent requests. */
+#if MPI_VERSION >= 4
+#define HAVE_PARTITIONED 1
+#else
+#define HAVE_PARTITIONED 0
+#endif
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+/* Compute columns first_column to last_column - 1 of a row */
+void compute_row_columns(int row_index, int first_column, int last_column, int width,
+                         double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    for (int j = first_column; j < last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat is conserved */
+        const int right_column_index = (j == width - 1) ? 0 : j + 1;
+        const int left_column_index = (j == 0) ? width - 1 : j - 1;
+        output_row[j] = 0.2 * (this_row[j] + this_row[left_column_index] + this_row[right_column_index] +
+                               top_row[j] + bottom_row[j]);
+    }
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    compute_row_columns(row_index, 0, width, width, input, output);
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* The reference, as in the MPI_THREAD_FUNNELED exercise: the border
+ * rows are sent by the main thread at the start of each step, and the
+ * threads only join in on the computation. */
+void run_funneled(int max_step, int n_rows, int width, double *data_sets[2],
+                  int up_rank, int down_rank, MPI_Comm comm)
+{
+    const int send_up_tag = 0, send_down_tag = 1;
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        double *working_data_set = data_sets[step % 2];
+        double *next_working_data_set = data_sets[1 - step % 2];
+        MPI_Request requests[4];
+        MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+        MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+        MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+        MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+
+        /* Do the local computation */
+#pragma omp parallel for
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+        /* Implied thread barrier here */
+
+        /* Wait for the halo-exchange receives, and do the non-local
+         * computation */
+        MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+        compute_row(1, width, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, width, working_data_set, next_working_data_set);
+        }
+        MPI_Waitall(2, &requests[2], MPI_STATUSES_IGNORE);
+    }
+}
+
+/* Create the halo requests bound to one buffer: receives into the
+ * ghost rows, followed by sends of the border rows. With partitioned
+ * requests, each row is split into n_partitions slices. */
+void init_halo_exchange(double *data_set, int n_rows, int width, int n_partitions,
+                        int up_rank, int down_rank, MPI_Comm comm, MPI_Request requests[4])
+{
+    const int send_up_tag = 0, send_down_tag = 1;
+#if HAVE_PARTITIONED
+    const int count = width / n_partitions;
+    MPI_Precv_init(row(data_set, n_rows + 1, width), n_partitions, count, MPI_DOUBLE, down_rank,
+                   send_up_tag, comm, MPI_INFO_NULL, &requests[0]);
+    MPI_Precv_init(row(data_set, 0, width), n_partitions, count, MPI_DOUBLE, up_rank,
+                   send_down_tag, comm, MPI_INFO_NULL, &requests[1]);
+    MPI_Psend_init(row(data_set, 1, width), n_partitions, count, MPI_DOUBLE, up_rank,
+                   send_up_tag, comm, MPI_INFO_NULL, &requests[2]);
+    MPI_Psend_init(row(data_set, n_rows, width), n_partitions, count, MPI_DOUBLE, down_rank,
+                   send_down_tag, comm, MPI_INFO_NULL, &requests[3]);
+#else
+    (void)n_partitions;
+    MPI_Recv_init(row(data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                  send_up_tag, comm, &requests[0]);
+    MPI_Recv_init(row(data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                  send_down_tag, comm, &requests[1]);
+    MPI_Send_init(row(data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                  send_up_tag, comm, &requests[2]);
+    MPI_Send_init(row(data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                  send_down_tag, comm, &requests[3]);
+#endif
+}
+
+/* Start the exchange of the border rows of a buffer. Partitioned sends
+ * start now, and each slice is transferred once it is marked ready.
+ * Ordinary sends can only start once the rows are complete, see
+ * border_rows_ready(). */
+void start_halo_exchange(MPI_Request requests[4])
+{
+#if HAVE_PARTITIONED
+    MPI_Startall(4, requests);
+#else
+    MPI_Startall(2, requests);
+#endif
+}
+
+/* Called by the main thread once all slices of the border rows are
+ * computed */
+void border_rows_ready(MPI_Request requests[4], int n_partitions, int threads_marked_ready)
+{
+#if HAVE_PARTITIONED
+    if (!threads_marked_ready)
+    {
+        MPI_Pready_range(0, n_partitions - 1, requests[2]);
+        MPI_Pready_range(0, n_partitions - 1, requests[3]);
+    }
+#else
+    (void)n_partitions;
+    (void)threads_marked_ready;
+    MPI_Startall(2, &requests[2]);
+#endif
+}
+
+/* The border rows of the output are computed first, in slices. Each
+ * thread marks its slice ready as soon as it is done, so the transfer
+ * to the neighbour proceeds while the interior rows are computed, and
+ * the next step finds its halo already there. That needs
+ * MPI_THREAD_MULTIPLE; otherwise the main thread marks all the slices
+ * ready once they are all done. */
+void run_partitioned(int max_step, int n_rows, int width, int n_partitions,
+                     int threads_mark_ready, double *data_sets[2],
+                     int up_rank, int down_rank, MPI_Comm comm)
+{
+    MPI_Request requests[2][4];
+    init_halo_exchange(data_sets[0], n_rows, width, n_partitions, up_rank, down_rank, comm, requests[0]);
+    init_halo_exchange(data_sets[1], n_rows, width, n_partitions, up_rank, down_rank, comm, requests[1]);
+    int sends_started[2] = {0, 0};
+
+    /* Exchange the initial border rows */
+    if (max_step > 0)
+    {
+        start_halo_exchange(requests[0]);
+        border_rows_ready(requests[0], n_partitions, 0);
+        sends_started[0] = 1;
+    }
+
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        const int p = step % 2;
+        double *working_data_set = data_sets[p];
+        double *next_working_data_set = data_sets[1 - p];
+        const int exchange_output = (step + 1 < max_step);
+
+        /* Start the exchange of the output border rows, which needs
+         * the sends from that buffer two steps ago to be done */
+        if (exchange_output)
+        {
+            if (sends_started[1 - p])
+            {
+                MPI_Waitall(2, &requests[1 - p][2], MPI_STATUSES_IGNORE);
+            }
+            start_halo_exchange(requests[1 - p]);
+        }
+
+        /* Wait for the halo data, sent during the previous step */
+        MPI_Waitall(2, requests[p], MPI_STATUSES_IGNORE);
+
+#pragma omp parallel
+        {
+            /* Compute the border rows of the output, one slice per
+             * partition */
+#pragma omp for schedule(static)
+            for (int k = 0; k < n_partitions; k = k + 1)
+            {
+                const int first_column = k * (width / n_partitions);
+                const int last_column = (k == n_partitions - 1) ? width : first_column + width / n_partitions;
+                compute_row_columns(1, first_column, last_column, width,
+                                    working_data_set, next_working_data_set);
+                compute_row_columns(n_rows, first_column, last_column, width,
+                                    working_data_set, next_working_data_set);
+#if HAVE_PARTITIONED
+                if (exchange_output && threads_mark_ready)
+                {
+                    MPI_Pready(k, requests[1 - p][2]);
+                    MPI_Pready(k, requests[1 - p][3]);
+                }
+#endif
+            }
+            /* Implied thread barrier here */
+
+#pragma omp master
+            if (exchange_output)
+            {
+                border_rows_ready(requests[1 - p], n_partitions, threads_mark_ready);
+            }
+
+            /* Do the interior computation while the border rows travel */
+#pragma omp for
+            for (int i = 2; i < n_rows; i = i + 1)
+            {
+                compute_row(i, width, working_data_set, next_working_data_set);
+            }
+        }
+        /* End thread-parallel region */
+        if (exchange_output)
+        {
+            sends_started[1 - p] = 1;
+        }
+    }
+
+    /* Clean up */
+    for (int q = 0; q < 2; q = q + 1)
+    {
+        if (sends_started[q])
+        {
+            MPI_Waitall(2, &requests[q][2], MPI_STATUSES_IGNORE);
+        }
+        for (int k = 0; k < 4; k = k + 1)
+        {
+            MPI_Request_free(&requests[q][k]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment and check. Threads can only mark
+     * their own slices ready with MPI_THREAD_MULTIPLE, but the code
+     * also works with MPI_THREAD_FUNNELED. */
+    int provided, required = MPI_THREAD_FUNNELED;
+    MPI_Init_thread(&argc, &argv, HAVE_PARTITIONED ? MPI_THREAD_MULTIPLE : required, &provided);
+    MPI_Comm comm = MPI_COMM_WORLD;
+
+    /* If the program can't run, stop running */
+    if (provided < required)
+    {
+        printf("Sorry, the MPI library does not provide "
+               "this threading level! Aborting!\n");
+        MPI_Abort(comm, 1);
+    }
+    const int threads_mark_ready = HAVE_PARTITIONED && (provided == MPI_THREAD_MULTIPLE);
+
+    /* The ranks form a ring */
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+
+    int n_global_rows = 2048, width = 2048, max_step = 100;
+    if (argc > 1 && argc != 4)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+    if (argc == 4)
+    {
+        n_global_rows = atoi(argv[1]);
+        width = atoi(argv[2]);
+        max_step = atoi(argv[3]);
+    }
+    if (n_global_rows < size)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Every rank needs at least one row\n");
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* Use a partition per thread. Every partition must hold the same
+     * number of values, so use fewer if the threads don't divide the
+     * row width. */
+    int n_partitions = omp_get_max_threads();
+    while (width % n_partitions != 0)
+    {
+        n_partitions = n_partitions - 1;
+    }
+
+    int n_rows, row_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+    const size_t n_values = (size_t)(n_rows + 2) * width;
+    double *data_sets[2];
+    data_sets[0] = (double *)(malloc(sizeof(double) * n_values));
+    data_sets[1] = (double *)(malloc(sizeof(double) * n_values));
+
+    /* Run both versions from the same initial values */
+    const char *version_names[] = {"funneled", HAVE_PARTITIONED ? "partitioned" : "persistent fallback"};
+    double elapsed[2], sum_of_squares[2];
+    for (int version = 0; version < 2; version = version + 1)
+    {
+        for (size_t k = 0; k < n_values; k = k + 1)
+        {
+            data_sets[0][k] = data_sets[1][k] = 0;
+        }
+        for (int i = 1; i <= n_rows; i = i + 1)
+        {
+            for (int j = 0; j < width; j = j + 1)
+            {
+                row(data_sets[0], i, width)[j] = (double)((row_offset + i - 1 + 2 * j) % 7);
+            }
+        }
+
+        MPI_Barrier(comm);
+        const double start_time = MPI_Wtime();
+        if (version == 0)
+        {
+            run_funneled(max_step, n_rows, width, data_sets, up_rank, down_rank, comm);
+        }
+        else
+        {
+            run_partitioned(max_step, n_rows, width, n_partitions, threads_mark_ready,
+                            data_sets, up_rank, down_rank, comm);
+        }
+        const double local_elapsed = MPI_Wtime() - start_time;
+        MPI_Reduce(&local_elapsed, &elapsed[version], 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+        double local_sum = 0;
+        for (int i = 1; i <= n_rows; i = i + 1)
+        {
+            for (int j = 0; j < width; j = j + 1)
+            {
+                const double value = row(data_sets[max_step % 2], i, width)[j];
+                local_sum += value * value;
+            }
+        }
+        MPI_Reduce(&local_sum, &sum_of_squares[version], 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+    }
+
+    /* Report whether the code is correct, and how fast */
+    if (rank == 0)
+    {
+        if (!HAVE_PARTITIONED)
+        {
+            printf("This MPI library does not support partitioned communication, "
+                   "so whole rows are sent with persistent requests instead\n");
+        }
+        else if (!threads_mark_ready)
+        {
+            printf("MPI_THREAD_MULTIPLE is not available, so the main thread marks "
+                   "the partitions ready\n");
+        }
+        printf("Grid of %d x %d cells on %d ranks, %d partitions per row, %d steps\n",
+               n_global_rows, width, size, n_partitions, max_step);
+        for (int version = 0; version < 2; version = version + 1)
+        {
+            printf("%-20s %12.6f s\n", version_names[version], elapsed[version]);
+        }
+        if (sum_of_squares[0] == sum_of_squares[1])
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    free(data_sets[0]);
+    free(data_sets[1]);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The halo exchange can use two-sided messages as in the other stencil
+ * exercises, or write the border rows directly into the ghost rows of
+ * the neighbours with MPI_Put, synchronized with post/start/complete/
+ * wait on the group of neighbours only. */
+enum halo_backend
+{
+    TWO_SIDED = 0,
+    ONE_SIDED = 1
+};
+const char *halo_backend_names[] = {"two-sided", "MPI_Put + PSCW"};
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+void compute_row(int row_index, int width, double *input, double *output)
+{
+    const double *top_row = row(input, row_index - 1, width);
+    const double *this_row = row(input, row_index, width);
+    const double *bottom_row = row(input, row_index + 1, width);
+    double *output_row = row(output, row_index, width);
+    for (int j = 0; j < width; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat is conserved */
+        const int right_column_index = (j == width - 1) ? 0 : j + 1;
+        const int left_column_index = (j == 0) ? width - 1 : j - 1;
+        output_row[j] = 0.2 * (this_row[j] + this_row[left_column_index] + this_row[right_column_index] +
+                               top_row[j] + bottom_row[j]);
+    }
+}
+
+/* Run n_steps heat-propagation steps on a tile of n_rows x width
+ * cells. Both buffers live in one window, so that either can be the
+ * target of the puts. Returns the time taken on this rank, and the
+ * total heat and sum of squares over all ranks. */
+double run_steps(enum halo_backend backend, int n_steps, int n_rows, int width,
+                 MPI_Comm comm, double *total, double *sum_of_squares)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+
+    /* Every rank has the same tile size, so the neighbours' ghost rows
+     * are at the same displacements as ours */
+    const MPI_Aint buffer_size = (MPI_Aint)(n_rows + 2) * width;
+    double *window_buffer;
+    MPI_Win win;
+    MPI_Win_allocate(2 * buffer_size * (MPI_Aint)sizeof(double), sizeof(double), MPI_INFO_NULL,
+                     comm, &window_buffer, &win);
+    double *data_sets[2] = {window_buffer, window_buffer + buffer_size};
+    for (MPI_Aint k = 0; k < 2 * buffer_size; k = k + 1)
+    {
+        window_buffer[k] = 0;
+    }
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(data_sets[0], i, width)[j] = (double)((rank * n_rows + i - 1 + 2 * j) % 7);
+        }
+    }
+
+    /* Post/Start/Complete/Wait works with process groups. Both the
+     * origin and the target group are our neighbours. */
+    MPI_Group comm_group, neighbours;
+    MPI_Comm_group(comm, &comm_group);
+    int neighbour_ranks[2] = {up_rank, down_rank};
+    MPI_Group_incl(comm_group, (up_rank == down_rank) ? 1 : 2, neighbour_ranks, &neighbours);
+
+    const int send_up_tag = 0, send_down_tag = 1;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < n_steps; step = step + 1)
+    {
+        const int p = step % 2;
+        double *working_data_set = data_sets[p];
+        double *next_working_data_set = data_sets[1 - p];
+        MPI_Request requests[4];
+        if (backend == ONE_SIDED)
+        {
+            /* Expose our ghost rows to the neighbours, and put our
+             * border rows into theirs */
+            MPI_Win_post(neighbours, 0, win);
+            MPI_Win_start(neighbours, 0, win);
+            MPI_Put(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                    p * buffer_size + (MPI_Aint)(n_rows + 1) * width, width, MPI_DOUBLE, win);
+            MPI_Put(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                    p * buffer_size, width, MPI_DOUBLE, win);
+        }
+        else
+        {
+            MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                      send_up_tag, comm, &requests[0]);
+            MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                      send_down_tag, comm, &requests[1]);
+            MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                      send_up_tag, comm, &requests[2]);
+            MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                      send_down_tag, comm, &requests[3]);
+        }
+
+        /* Do the local computation */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(i, width, working_data_set, next_working_data_set);
+        }
+
+        /* Wait for the halo data to arrive */
+        if (backend == ONE_SIDED)
+        {
+            /* Our puts are done, and so are those into our ghost rows */
+            MPI_Win_complete(win);
+            MPI_Win_wait(win);
+        }
+        else
+        {
+            MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+        }
+
+        /* Do the non-local computation */
+        compute_row(1, width, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            compute_row(n_rows, width, working_data_set, next_working_data_set);
+        }
+    }
+    const double elapsed = MPI_Wtime() - start_time;
+
+    double local_sums[2] = {0, 0}, sums[2];
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            const double value = row(data_sets[n_steps % 2], i, width)[j];
+            local_sums[0] += value;
+            local_sums[1] += value * value;
+        }
+    }
+    MPI_Allreduce(local_sums, sums, 2, MPI_DOUBLE, MPI_SUM, comm);
+    *total = sums[0];
+    *sum_of_squares = sums[1];
+
+    /* Free the window and groups */
+    MPI_Group_free(&neighbours);
+    MPI_Group_free(&comm_group);
+    MPI_Win_free(&win);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    int n_repeats = 10000;
+    if (argc > 1)
+    {
+        n_repeats = atoi(argv[1]);
+    }
+    const int n_rows = 4;
+    const int widths[] = {8, 64, 512, 4096, 32768};
+    const int n_widths = sizeof(widths) / sizeof(widths[0]);
+
+    /* Check that both backends compute the same steps */
+    int success = 1;
+    double totals[2], sums_of_squares[2];
+    for (int backend = 0; backend < 2; backend = backend + 1)
+    {
+        run_steps(backend, 10, n_rows, 8, comm, &totals[backend], &sums_of_squares[backend]);
+    }
+    double initial_total, initial_sum_of_squares;
+    run_steps(TWO_SIDED, 0, n_rows, 8, comm, &initial_total, &initial_sum_of_squares);
+    success = (sums_of_squares[0] == sums_of_squares[1]) &&
+              (fabs(totals[0] - initial_total) <= 1e-9 * initial_total);
+
+    /* Compare the latency of a step, and the rate of halo messages, for
+     * a range of message sizes */
+    if (rank == 0)
+    {
+        printf("Halo exchange over %d steps on %d ranks, %d rows per rank\n", n_repeats, size, n_rows);
+        printf("%10s", "width");
+        for (int backend = 0; backend < 2; backend = backend + 1)
+        {
+            printf(" %15s %15s", halo_backend_names[backend], "msg/s per rank");
+        }
+        printf("\n");
+    }
+    for (int w = 0; w < n_widths; w = w + 1)
+    {
+        if (rank == 0)
+        {
+            printf("%10d", widths[w]);
+        }
+        for (int backend = 0; backend < 2; backend = backend + 1)
+        {
+            double total, sum_of_squares;
+            const double local_elapsed = run_steps(backend, n_repeats, n_rows, widths[w], comm,
+                                                   &total, &sum_of_squares);
+            double elapsed;
+            MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+            if (rank == 0)
+            {
+                printf(" %12.3f us %15.4g", elapsed / n_repeats * 1e6, 2.0 * n_repeats / elapsed);
+            }
+        }
+        if (rank == 0)
+        {
+            printf("\n");
+        }
+    }
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The halos can always travel as messages, or, for neighbours on the
+ * same node, be read directly from the neighbour's tile in a shared
+ * memory window. Neighbours on other nodes always use messages. */
+enum halo_mode
+{
+    MESSAGES = 0,
+    SHARED_MEMORY = 1
+};
+const char *halo_mode_names[] = {"messages", "shared memory"};
+
+/* Each rank owns n_rows full-width rows of the grid, stored with one
+ * ghost row above and below. The columns are periodic. */
+double *row(double *data_set, int row_index, int width)
+{
+    return data_set + (size_t)row_index * width;
+}
+
+/* The rows above and below need not be stored next to this row, so
+ * that they can be in a neighbour's tile */
+void compute_row(const double *top_row, const double *this_row, const double *bottom_row,
+                 double *output_row, int width)
+{
+    /* Here is the 5-point stencil, scaled by 1/5 so that the total heat
+     * is conserved. The periodic wrap-around columns are peeled out of
+     * the loop over the other columns. */
+    output_row[0] = 0.2 * (this_row[0] + this_row[width - 1] + this_row[1 % width] +
+                           top_row[0] + bottom_row[0]);
+    for (int j = 1; j < width - 1; j = j + 1)
+    {
+        output_row[j] = 0.2 * (this_row[j] + this_row[j - 1] + this_row[j + 1] +
+                               top_row[j] + bottom_row[j]);
+    }
+    if (width > 1)
+    {
+        output_row[width - 1] = 0.2 * (this_row[width - 1] + this_row[width - 2] + this_row[0] +
+                                       top_row[width - 1] + bottom_row[width - 1]);
+    }
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Run max_step steps on the ring of ranks in comm, where node_comm
+ * holds the ranks of comm that can share memory with this one. Returns
+ * the time this rank spent completing intra-node and inter-node halos
+ * and synchronizing the shared window, and the total heat and sum of
+ * squares over all ranks. */
+void run_steps(enum halo_mode mode, int max_step, int n_global_rows, int width,
+               MPI_Comm comm, MPI_Comm node_comm, double halo_times[3],
+               double *total, double *sum_of_squares)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    const int up_rank = (rank + size - 1) % size;
+    const int down_rank = (rank + 1) % size;
+    int n_rows, row_offset, n_up_rows, n_down_rows, unused_offset;
+    decompose(n_global_rows, size, rank, &n_rows, &row_offset);
+    decompose(n_global_rows, size, up_rank, &n_up_rows, &unused_offset);
+    decompose(n_global_rows, size, down_rank, &n_down_rows, &unused_offset);
+
+    /* Find out whether the neighbours are on this node, and if so,
+     * their ranks in node_comm */
+    MPI_Group group, node_group;
+    MPI_Comm_group(comm, &group);
+    MPI_Comm_group(node_comm, &node_group);
+    int neighbour_ranks[2] = {up_rank, down_rank}, node_neighbour_ranks[2];
+    MPI_Group_translate_ranks(group, 2, neighbour_ranks, node_group, node_neighbour_ranks);
+    MPI_Group_free(&group);
+    MPI_Group_free(&node_group);
+    const int up_is_intra = (node_neighbour_ranks[0] != MPI_UNDEFINED);
+    const int down_is_intra = (node_neighbour_ranks[1] != MPI_UNDEFINED);
+
+    /* Both buffers of every rank on the node live in one shared
+     * window, so a rank can load from the tiles of its neighbours */
+    const MPI_Aint buffer_size = (MPI_Aint)(n_rows + 2) * width;
+    double *window_buffer;
+    MPI_Win win;
+    MPI_Win_allocate_shared(2 * buffer_size * (MPI_Aint)sizeof(double), sizeof(double), MPI_INFO_NULL,
+                            node_comm, &window_buffer, &win);
+    double *data_sets[2] = {window_buffer, window_buffer + buffer_size};
+    for (MPI_Aint k = 0; k < 2 * buffer_size; k = k + 1)
+    {
+        window_buffer[k] = 0;
+    }
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            row(data_sets[0], i, width)[j] = (double)((row_offset + i - 1 + 2 * j) % 7);
+        }
+    }
+
+    /* Look up where the neighbours' tiles are in our address space */
+    double *up_data_sets[2] = {NULL, NULL}, *down_data_sets[2] = {NULL, NULL};
+    if (mode == SHARED_MEMORY && up_is_intra)
+    {
+        MPI_Aint segment_size;
+        int displacement_unit;
+        double *base;
+        MPI_Win_shared_query(win, node_neighbour_ranks[0], &segment_size, &displacement_unit, &base);
+        up_data_sets[0] = base;
+        up_data_sets[1] = base + (MPI_Aint)(n_up_rows + 2) * width;
+    }
+    if (mode == SHARED_MEMORY && down_is_intra)
+    {
+        MPI_Aint segment_size;
+        int displacement_unit;
+        double *base;
+        MPI_Win_shared_query(win, node_neighbour_ranks[1], &segment_size, &displacement_unit, &base);
+        down_data_sets[0] = base;
+        down_data_sets[1] = base + (MPI_Aint)(n_down_rows + 2) * width;
+    }
+
+    /* A passive-target epoch lasts for the whole run. Within it,
+     * MPI_Win_sync and a barrier on the node make the stores of one
+     * step visible to the loads of the next. */
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    MPI_Win_sync(win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(win);
+
+    const int send_up_tag = 0, send_down_tag = 1;
+    halo_times[0] = 0;
+    halo_times[1] = 0;
+    halo_times[2] = 0;
+    MPI_Barrier(comm);
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        const int p = step % 2;
+        double *working_data_set = data_sets[p];
+        double *next_working_data_set = data_sets[1 - p];
+
+        /* Exchange messages with the neighbours that need them. The
+         * first pair of requests is with the up neighbour, the second
+         * with the down neighbour. */
+        MPI_Request requests[4] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+        if (up_data_sets[p] == NULL)
+        {
+            MPI_Irecv(row(working_data_set, 0, width), width, MPI_DOUBLE, up_rank,
+                      send_down_tag, comm, &requests[0]);
+            MPI_Isend(row(working_data_set, 1, width), width, MPI_DOUBLE, up_rank,
+                      send_up_tag, comm, &requests[1]);
+        }
+        if (down_data_sets[p] == NULL)
+        {
+            MPI_Irecv(row(working_data_set, n_rows + 1, width), width, MPI_DOUBLE, down_rank,
+                      send_up_tag, comm, &requests[2]);
+            MPI_Isend(row(working_data_set, n_rows, width), width, MPI_DOUBLE, down_rank,
+                      send_down_tag, comm, &requests[3]);
+        }
+
+        /* Do the local computation */
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            compute_row(row(working_data_set, i - 1, width), row(working_data_set, i, width),
+                        row(working_data_set, i + 1, width), row(next_working_data_set, i, width), width);
+        }
+
+        /* Wait for the messages, and charge the time to the kind of
+         * neighbour they came from */
+        double start_time = MPI_Wtime();
+        MPI_Waitall(2, &requests[0], MPI_STATUSES_IGNORE);
+        halo_times[up_is_intra ? 0 : 1] += MPI_Wtime() - start_time;
+        start_time = MPI_Wtime();
+        MPI_Waitall(2, &requests[2], MPI_STATUSES_IGNORE);
+        halo_times[down_is_intra ? 0 : 1] += MPI_Wtime() - start_time;
+
+        /* Do the non-local computation, loading the neighbours' border
+         * rows directly where we can */
+        const double *top_row = (up_data_sets[p] != NULL) ? row(up_data_sets[p], n_up_rows, width)
+                                                           : row(working_data_set, 0, width);
+        const double *bottom_row = (down_data_sets[p] != NULL) ? row(down_data_sets[p], 1, width)
+                                                               : row(working_data_set, n_rows + 1, width);
+        compute_row(top_row, row(working_data_set, 1, width),
+                    (n_rows > 1) ? row(working_data_set, 2, width) : bottom_row,
+                    row(next_working_data_set, 1, width), width);
+        if (n_rows > 1)
+        {
+            compute_row(row(working_data_set, n_rows - 1, width), row(working_data_set, n_rows, width),
+                        bottom_row, row(next_working_data_set, n_rows, width), width);
+        }
+
+        /* Nobody may overwrite a buffer until the neighbours have
+         * finished loading from it, nor load from one until its owner
+         * has finished storing to it. Every rank on the node takes part,
+         * even one with no neighbour there, so this is charged to
+         * neither kind of halo. */
+        if (mode == SHARED_MEMORY)
+        {
+            start_time = MPI_Wtime();
+            MPI_Win_sync(win);
+            MPI_Barrier(node_comm);
+            MPI_Win_sync(win);
+            halo_times[2] += MPI_Wtime() - start_time;
+        }
+    }
+    MPI_Win_unlock_all(win);
+
+    double local_sums[2] = {0, 0}, sums[2];
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            const double value = row(data_sets[max_step % 2], i, width)[j];
+            local_sums[0] += value;
+            local_sums[1] += value * value;
+        }
+    }
+    MPI_Allreduce(local_sums, sums, 2, MPI_DOUBLE, MPI_SUM, comm);
+    *total = sums[0];
+    *sum_of_squares = sums[1];
+
+    /* Free the window */
+    MPI_Win_free(&win);
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment. The ranks form a ring. */
+    MPI_Init(&argc, &argv);
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    /* Read the global grid size and number of steps. With
+     * --ranks-per-node, the ranks that share memory are split further,
+     * so that inter-node neighbours can be tried out on one node. */
+    int n_global_rows = 512, width = 512, max_step = 1000, ranks_per_node = 0;
+    int n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--ranks-per-node") == 0 && k + 1 < argc)
+        {
+            ranks_per_node = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (n_arguments < 3)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        width = arguments[1];
+        max_step = arguments[2];
+    }
+    if ((n_arguments != 0 && n_arguments != 3) || n_global_rows < size || width < 1 ||
+        max_step < 0 || ranks_per_node < 0)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--ranks-per-node N]\n", argv[0]);
+        }
+        MPI_Abort(comm, 1);
+    }
+
+    /* Group the ranks that can share memory */
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    if (ranks_per_node > 0)
+    {
+        int node_rank;
+        MPI_Comm_rank(node_comm, &node_rank);
+        MPI_Comm emulated_node_comm;
+        MPI_Comm_split(node_comm, node_rank / ranks_per_node, node_rank, &emulated_node_comm);
+        MPI_Comm_free(&node_comm);
+        node_comm = emulated_node_comm;
+    }
+    int node_size;
+    MPI_Comm_size(node_comm, &node_size);
+
+    /* Run both modes, and check they compute the same steps */
+    double initial_total, initial_sum_of_squares, halo_times[3];
+    run_steps(MESSAGES, 0, n_global_rows, width, comm, node_comm, halo_times,
+              &initial_total, &initial_sum_of_squares);
+    if (rank == 0)
+    {
+        printf("Halo exchange over %d steps of a %d x %d grid on %d ranks, %d on this node\n",
+               max_step, n_global_rows, width, size, node_size);
+        printf("%14s %16s %16s %16s %16s\n", "mode", "intra-node (us)", "inter-node (us)", "node sync (us)",
+               "time/step (us)");
+    }
+    int success = 1;
+    double totals[2], sums_of_squares[2];
+    for (int mode = 0; mode < 2; mode = mode + 1)
+    {
+        MPI_Barrier(comm);
+        const double start_time = MPI_Wtime();
+        run_steps(mode, max_step, n_global_rows, width, comm, node_comm, halo_times,
+                  &totals[mode], &sums_of_squares[mode]);
+        const double local_elapsed = MPI_Wtime() - start_time;
+
+        /* Report the halo times of the slowest rank, per step */
+        double local_times[4] = {halo_times[0], halo_times[1], halo_times[2], local_elapsed}, times[4];
+        MPI_Reduce(local_times, times, 4, MPI_DOUBLE, MPI_MAX, 0, comm);
+        if (rank == 0 && max_step > 0)
+        {
+            printf("%14s %16.3f %16.3f %16.3f %16.3f\n", halo_mode_names[mode], times[0] / max_step * 1e6,
+                   times[1] / max_step * 1e6, times[2] / max_step * 1e6, times[3] / max_step * 1e6);
+        }
+        success = success && (fabs(totals[mode] - initial_total) <= 1e-9 * initial_total);
+    }
+    success = success && (sums_of_squares[0] == sums_of_squares[1]);
+
+    /* Report whether the code is correct */
+    if (rank == 0)
+    {
+        if (success)
+        {
+            printf("SUCCESS on rank %d!\n", rank);
+        }
+        else
+        {
+            printf("Improvement needed before rank %d can report success!\n", rank);
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Comm_free(&node_comm);
+    MPI_Finalize();
+    return 0;
+}
@@ -0,0 +1,777 @@
+#include "mpi.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The ways of running the stencil that are compared. They are the halo
+ * exchanges of the other stencil exercises: a ring of ranks with
+ * blocking, nonblocking or persistent messages, with the output copied
+ * back or swapped, a 2D Cartesian grid of ranks, the same grid with a
+ * neighbourhood collective, and a ring with MPI_Put and PSCW. Each
+ * exercise stays self-contained, so the exchanges are written again
+ * here, behind one interface that the timing loop drives. They all
+ * compute exactly the same grid. */
+enum variant
+{
+    SENDRECV = 0,
+    NONBLOCKING = 1,
+    PERSISTENT = 2,
+    NONBLOCKING_COPY = 3,
+    CARTESIAN_2D = 4,
+    NEIGHBOR_ALLTOALLW = 5,
+    RMA_PSCW = 6,
+    N_VARIANTS = 7
+};
+const char *variant_names[] = {"sendrecv",     "nonblocking",        "persistent", "nonblocking-copy",
+                               "cartesian-2d", "neighbor-alltoallw", "rma-pscw"};
+
+/* The phases of a step that are timed separately. The halo phase is
+ * starting the exchange and waiting for it to complete. */
+enum phase
+{
+    COMPUTE = 0,
+    HALO_WAIT = 1,
+    REDUCTION_WAIT = 2,
+    COPY = 3,
+    N_PHASES = 4
+};
+const char *phase_names[] = {"compute", "halo_wait", "reduction_wait", "copy"};
+
+enum output_format
+{
+    TEXT = 0,
+    CSV = 1,
+    JSON = 2
+};
+
+/* A stencil update does 4 additions and 1 multiplication, and at best
+ * reads the input and writes the output once, plus the write-allocate
+ * of the output cache line. Copying the output back, rather than
+ * swapping the buffers, moves another read and write. */
+#define FLOPS_PER_CELL 5.0
+#define BYTES_PER_CELL (3.0 * sizeof(double))
+#define COPY_BYTES_PER_CELL (2.0 * sizeof(double))
+
+/* Each rank owns a tile of n_rows x n_columns cells of the global
+ * grid, which is periodic in both directions. The tile is stored with
+ * one ghost row above and below and one ghost column left and right,
+ * ie as (n_rows+2) x (n_columns+2) values in row-major order. The ring
+ * variants own full rows, and fill their ghost columns from their own
+ * tile. */
+#define INDEX(i, j, n_columns) ((size_t)(i) * (size_t)((n_columns) + 2) + (size_t)(j))
+
+struct tile
+{
+    int n_rows, n_columns, row_offset, column_offset;
+    double *data_sets[2];
+};
+
+/* Update columns first_column to last_column of one row, and return
+ * the sum of their new values. Every variant uses this, with the same
+ * order of additions, so they agree bitwise. */
+double compute_row(int row_index, int first_column, int last_column, int n_columns,
+                   const double *input, double *output)
+{
+    const size_t stride = (size_t)n_columns + 2;
+    double sum = 0;
+    for (int j = first_column; j <= last_column; j = j + 1)
+    {
+        /* Here is the 5-point stencil, scaled by 1/5 so that the total
+         * heat is conserved */
+        const size_t center = INDEX(row_index, j, n_columns);
+        output[center] = 0.2 * (input[center] +
+                                input[center - 1] +
+                                input[center + 1] +
+                                input[center - stride] +
+                                input[center + stride]);
+        sum += output[center];
+    }
+    return sum;
+}
+
+/* Split n items over n_parts parts as evenly as possible, and return
+ * the size of, and first item in, the given part. */
+void decompose(int n, int n_parts, int part, int *n_local, int *offset)
+{
+    const int base = n / n_parts, remainder = n % n_parts;
+    *n_local = base + ((part < remainder) ? 1 : 0);
+    *offset = part * base + ((part < remainder) ? part : remainder);
+}
+
+/* Make one subarray datatype per direction for the border cells sent,
+ * and one for the ghost cells received, as in neighbor-halo-exchange.c.
+ * The directions are in the order up, down, left, right. */
+void create_halo_types(int n_rows, int n_columns, MPI_Datatype send_types[4], MPI_Datatype recv_types[4])
+{
+    const int sizes[2] = {n_rows + 2, n_columns + 2};
+    const int row_subsizes[2] = {1, n_columns}, column_subsizes[2] = {n_rows, 1};
+    const int *subsizes[4] = {row_subsizes, row_subsizes, column_subsizes, column_subsizes};
+    const int send_starts[4][2] = {{1, 1}, {n_rows, 1}, {1, 1}, {1, n_columns}};
+    const int recv_starts[4][2] = {{0, 1}, {n_rows + 1, 1}, {1, 0}, {1, n_columns + 1}};
+    for (int d = 0; d < 4; d = d + 1)
+    {
+        MPI_Type_create_subarray(2, sizes, subsizes[d], send_starts[d], MPI_ORDER_C, MPI_DOUBLE, &send_types[d]);
+        MPI_Type_commit(&send_types[d]);
+        MPI_Type_create_subarray(2, sizes, subsizes[d], recv_starts[d], MPI_ORDER_C, MPI_DOUBLE, &recv_types[d]);
+        MPI_Type_commit(&recv_types[d]);
+    }
+}
+
+/* Make a distributed graph communicator over the ranks of the periodic
+ * Cartesian communicator comm, listing the sources as up, down, left,
+ * right and so the destinations as down, up, right, left, as in
+ * neighbor-halo-exchange.c */
+MPI_Comm create_halo_graph(MPI_Comm comm)
+{
+    int sources[4], destinations[4];
+    const int weights[4] = {1, 1, 1, 1};
+    MPI_Cart_shift(comm, 0, 1, &sources[0], &sources[1]);
+    MPI_Cart_shift(comm, 1, 1, &sources[2], &sources[3]);
+    for (int k = 0; k < 4; k = k + 1)
+    {
+        destinations[k] = sources[k ^ 1];
+    }
+    MPI_Comm graph_comm;
+    MPI_Dist_graph_create_adjacent(comm, 4, sources, weights, 4, destinations, weights,
+                                   MPI_INFO_NULL, 0, &graph_comm);
+    return graph_comm;
+}
+
+/* Everything a variant needs to exchange the halos of either buffer of
+ * a tile. It is set up once, then each step starts the exchange, does
+ * the computation that needs no halo data, and finishes the exchange. */
+struct halo_exchange
+{
+    enum variant variant;
+    MPI_Comm comm, graph_comm;
+    int neighbours[4];
+    MPI_Request requests[8];
+    int n_requests;
+    /* for the persistent variant, a set of requests per buffer */
+    MPI_Request persistent_requests[2][4];
+    /* for the 2D variants */
+    MPI_Datatype column_type, send_types[4], recv_types[4], graph_send_types[4];
+    /* for the one-sided variant */
+    MPI_Win win;
+    MPI_Group comm_group, neighbour_group;
+    MPI_Aint up_ghost_displacements[2], down_ghost_displacements[2];
+};
+
+enum direction
+{
+    UP = 0,
+    DOWN = 1,
+    LEFT = 2,
+    RIGHT = 3
+};
+
+int is_2d(enum variant variant)
+{
+    return variant == CARTESIAN_2D || variant == NEIGHBOR_ALLTOALLW;
+}
+
+/* Set up the exchange on the periodic Cartesian communicator comm,
+ * whose neighbourhood graph is graph_comm, and allocate the buffers of
+ * the tile, which for the one-sided variant live in a window. */
+void init_halo_exchange(struct halo_exchange *halo, enum variant variant, MPI_Comm comm, MPI_Comm graph_comm,
+                        int n_global_rows, struct tile *tile)
+{
+    halo->variant = variant;
+    halo->comm = comm;
+    halo->graph_comm = graph_comm;
+    halo->n_requests = 0;
+    MPI_Cart_shift(comm, 0, 1, &halo->neighbours[UP], &halo->neighbours[DOWN]);
+    MPI_Cart_shift(comm, 1, 1, &halo->neighbours[LEFT], &halo->neighbours[RIGHT]);
+    const int n_rows = tile->n_rows, n_columns = tile->n_columns;
+    const MPI_Aint buffer_size = (MPI_Aint)(n_rows + 2) * (n_columns + 2);
+
+    if (variant == RMA_PSCW)
+    {
+        double *window_buffer;
+        MPI_Win_allocate(2 * buffer_size * (MPI_Aint)sizeof(double), sizeof(double), MPI_INFO_NULL, comm,
+                         &window_buffer, &halo->win);
+        tile->data_sets[0] = window_buffer;
+        tile->data_sets[1] = window_buffer + buffer_size;
+        memset(window_buffer, 0, sizeof(double) * 2 * buffer_size);
+
+        /* The neighbours may own a different number of rows, so find
+         * where their ghost rows are in their part of the window */
+        int dims[2], periods[2], coords[2], n_up_rows, n_down_rows, unused_offset;
+        MPI_Cart_get(comm, 2, dims, periods, coords);
+        decompose(n_global_rows, dims[0], (coords[0] + dims[0] - 1) % dims[0], &n_up_rows, &unused_offset);
+        decompose(n_global_rows, dims[0], (coords[0] + 1) % dims[0], &n_down_rows, &unused_offset);
+        for (int p = 0; p < 2; p = p + 1)
+        {
+            halo->up_ghost_displacements[p] = p * (MPI_Aint)(n_up_rows + 2) * (n_columns + 2) +
+                                              (MPI_Aint)INDEX(n_up_rows + 1, 1, n_columns);
+            halo->down_ghost_displacements[p] = p * (MPI_Aint)(n_down_rows + 2) * (n_columns + 2) +
+                                                (MPI_Aint)INDEX(0, 1, n_columns);
+        }
+
+        /* Both the origin and the target group are our neighbours */
+        MPI_Comm_group(comm, &halo->comm_group);
+        const int neighbour_ranks[2] = {halo->neighbours[UP], halo->neighbours[DOWN]};
+        MPI_Group_incl(halo->comm_group, (neighbour_ranks[0] == neighbour_ranks[1]) ? 1 : 2, neighbour_ranks,
+                       &halo->neighbour_group);
+        return;
+    }
+
+    tile->data_sets[0] = (double *)(calloc(buffer_size, sizeof(double)));
+    tile->data_sets[1] = (double *)(calloc(buffer_size, sizeof(double)));
+    if (variant == PERSISTENT)
+    {
+        for (int p = 0; p < 2; p = p + 1)
+        {
+            double *data_set = tile->data_sets[p];
+            MPI_Recv_init(&data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                          halo->neighbours[DOWN], UP, comm, &halo->persistent_requests[p][0]);
+            MPI_Recv_init(&data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE,
+                          halo->neighbours[UP], DOWN, comm, &halo->persistent_requests[p][1]);
+            MPI_Send_init(&data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE,
+                          halo->neighbours[UP], UP, comm, &halo->persistent_requests[p][2]);
+            MPI_Send_init(&data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE,
+                          halo->neighbours[DOWN], DOWN, comm, &halo->persistent_requests[p][3]);
+        }
+    }
+    else if (variant == CARTESIAN_2D)
+    {
+        MPI_Type_vector(n_rows, 1, n_columns + 2, MPI_DOUBLE, &halo->column_type);
+        MPI_Type_commit(&halo->column_type);
+    }
+    else if (variant == NEIGHBOR_ALLTOALLW)
+    {
+        create_halo_types(n_rows, n_columns, halo->send_types, halo->recv_types);
+        for (int d = 0; d < 4; d = d + 1)
+        {
+            halo->graph_send_types[d] = halo->send_types[d ^ 1];
+        }
+    }
+}
+
+/* The ring variants own full rows, so their ghost columns are copies
+ * of their own columns at the other end */
+void wrap_columns(const struct tile *tile, double *data_set)
+{
+    for (int i = 1; i <= tile->n_rows; i = i + 1)
+    {
+        data_set[INDEX(i, 0, tile->n_columns)] = data_set[INDEX(i, tile->n_columns, tile->n_columns)];
+        data_set[INDEX(i, tile->n_columns + 1, tile->n_columns)] = data_set[INDEX(i, 1, tile->n_columns)];
+    }
+}
+
+/* Start the exchange of the halos of buffer p. The blocking variant
+ * completes it here. */
+void start_halo_exchange(struct halo_exchange *halo, const struct tile *tile, int p)
+{
+    double *data_set = tile->data_sets[p];
+    const int n_rows = tile->n_rows, n_columns = tile->n_columns;
+    const int *neighbours = halo->neighbours;
+    if (!is_2d(halo->variant))
+    {
+        wrap_columns(tile, data_set);
+    }
+
+    /* What is sent in direction d arrives from the opposite direction,
+     * d ^ 1, so the direction is also the tag */
+    if (halo->variant == SENDRECV)
+    {
+        MPI_Sendrecv(&data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[UP], UP,
+                     &data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[DOWN], UP,
+                     halo->comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(&data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[DOWN], DOWN,
+                     &data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[UP], DOWN,
+                     halo->comm, MPI_STATUS_IGNORE);
+        halo->n_requests = 0;
+    }
+    else if (halo->variant == PERSISTENT)
+    {
+        memcpy(halo->requests, halo->persistent_requests[p], sizeof(MPI_Request) * 4);
+        MPI_Startall(4, halo->requests);
+        halo->n_requests = 4;
+    }
+    else if (halo->variant == NONBLOCKING || halo->variant == NONBLOCKING_COPY ||
+             halo->variant == CARTESIAN_2D)
+    {
+        MPI_Irecv(&data_set[INDEX(n_rows + 1, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[DOWN], UP,
+                  halo->comm, &halo->requests[0]);
+        MPI_Irecv(&data_set[INDEX(0, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[UP], DOWN,
+                  halo->comm, &halo->requests[1]);
+        MPI_Isend(&data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[UP], UP,
+                  halo->comm, &halo->requests[2]);
+        MPI_Isend(&data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[DOWN], DOWN,
+                  halo->comm, &halo->requests[3]);
+        halo->n_requests = 4;
+        if (halo->variant == CARTESIAN_2D)
+        {
+            MPI_Irecv(&data_set[INDEX(1, n_columns + 1, n_columns)], 1, halo->column_type, neighbours[RIGHT],
+                      LEFT, halo->comm, &halo->requests[4]);
+            MPI_Irecv(&data_set[INDEX(1, 0, n_columns)], 1, halo->column_type, neighbours[LEFT], RIGHT,
+                      halo->comm, &halo->requests[5]);
+            MPI_Isend(&data_set[INDEX(1, 1, n_columns)], 1, halo->column_type, neighbours[LEFT], LEFT,
+                      halo->comm, &halo->requests[6]);
+            MPI_Isend(&data_set[INDEX(1, n_columns, n_columns)], 1, halo->column_type, neighbours[RIGHT],
+                      RIGHT, halo->comm, &halo->requests[7]);
+            halo->n_requests = 8;
+        }
+    }
+    else if (halo->variant == NEIGHBOR_ALLTOALLW)
+    {
+        const int counts[4] = {1, 1, 1, 1};
+        const MPI_Aint displacements[4] = {0, 0, 0, 0};
+        MPI_Ineighbor_alltoallw(data_set, counts, displacements, halo->graph_send_types, data_set, counts,
+                                displacements, halo->recv_types, halo->graph_comm, &halo->requests[0]);
+        halo->n_requests = 1;
+    }
+    else
+    {
+        /* Expose our ghost rows to the neighbours, and put our border
+         * rows into theirs */
+        MPI_Win_post(halo->neighbour_group, 0, halo->win);
+        MPI_Win_start(halo->neighbour_group, 0, halo->win);
+        MPI_Put(&data_set[INDEX(1, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[UP],
+                halo->up_ghost_displacements[p], n_columns, MPI_DOUBLE, halo->win);
+        MPI_Put(&data_set[INDEX(n_rows, 1, n_columns)], n_columns, MPI_DOUBLE, neighbours[DOWN],
+                halo->down_ghost_displacements[p], n_columns, MPI_DOUBLE, halo->win);
+        halo->n_requests = 0;
+    }
+}
+
+/* Wait until the halos of the buffer are in place */
+void finish_halo_exchange(struct halo_exchange *halo)
+{
+    if (halo->variant == RMA_PSCW)
+    {
+        /* Our puts are done, and so are those into our ghost rows */
+        MPI_Win_complete(halo->win);
+        MPI_Win_wait(halo->win);
+    }
+    else
+    {
+        MPI_Waitall(halo->n_requests, halo->requests, MPI_STATUSES_IGNORE);
+    }
+}
+
+void free_halo_exchange(struct halo_exchange *halo, struct tile *tile)
+{
+    if (halo->variant == RMA_PSCW)
+    {
+        MPI_Group_free(&halo->neighbour_group);
+        MPI_Group_free(&halo->comm_group);
+        MPI_Win_free(&halo->win);
+        return;
+    }
+    if (halo->variant == PERSISTENT)
+    {
+        for (int p = 0; p < 2; p = p + 1)
+        {
+            for (int k = 0; k < 4; k = k + 1)
+            {
+                MPI_Request_free(&halo->persistent_requests[p][k]);
+            }
+        }
+    }
+    else if (halo->variant == CARTESIAN_2D)
+    {
+        MPI_Type_free(&halo->column_type);
+    }
+    else if (halo->variant == NEIGHBOR_ALLTOALLW)
+    {
+        for (int d = 0; d < 4; d = d + 1)
+        {
+            MPI_Type_free(&halo->send_types[d]);
+            MPI_Type_free(&halo->recv_types[d]);
+        }
+    }
+    free(tile->data_sets[0]);
+    free(tile->data_sets[1]);
+}
+
+/* What one variant achieved. The phase times are the totals over all
+ * steps on each rank, summarized over the ranks. The fingerprint is a
+ * sum over the cells of their bits, weighted by their global position,
+ * in integer arithmetic, so it is the same for any decomposition of
+ * the same grid. */
+struct benchmark_result
+{
+    enum variant variant;
+    int dims[2];
+    double elapsed;
+    double phase_min[N_PHASES], phase_avg[N_PHASES], phase_max[N_PHASES];
+    double total_heat;
+    uint64_t fingerprint;
+};
+
+/* Run max_step steps with the given variant on the periodic Cartesian
+ * communicator comm. Every reduce_interval steps, the total heat is
+ * summed over the ranks with MPI_Iallreduce, which is only waited for
+ * at the next such step, as a diagnostic would be. */
+void run_variant(enum variant variant, int max_step, int reduce_interval, int n_global_rows, int n_global_columns,
+                 MPI_Comm comm, MPI_Comm graph_comm, struct benchmark_result *result)
+{
+    int size, dims[2], periods[2], coords[2];
+    MPI_Comm_size(comm, &size);
+    MPI_Cart_get(comm, 2, dims, periods, coords);
+    struct tile tile;
+    decompose(n_global_rows, dims[0], coords[0], &tile.n_rows, &tile.row_offset);
+    decompose(n_global_columns, dims[1], coords[1], &tile.n_columns, &tile.column_offset);
+    const int n_rows = tile.n_rows, n_columns = tile.n_columns;
+    struct halo_exchange halo;
+    init_halo_exchange(&halo, variant, comm, graph_comm, n_global_rows, &tile);
+
+    /* Prepare the initial values, which depend only on the global
+     * position of each cell */
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            const int global_i = tile.row_offset + i - 1;
+            const int global_j = tile.column_offset + j - 1;
+            tile.data_sets[0][INDEX(i, j, n_columns)] = (double)((global_i + 2 * global_j) % 7);
+        }
+    }
+
+    double phase_times[N_PHASES] = {0, 0, 0, 0};
+    double local_heat = 0, global_heat = 0;
+    MPI_Request reduction_request = MPI_REQUEST_NULL;
+    int p = 0;
+    MPI_Barrier(comm);
+    const double start_time = MPI_Wtime();
+    for (int step = 0; step < max_step; step = step + 1)
+    {
+        const double *working_data_set = tile.data_sets[p];
+        double *next_working_data_set = tile.data_sets[1 - p];
+        double local_step_heat = 0;
+
+        /* Start the halo exchange, and overlap it with the computation
+         * that needs no halo data */
+        double phase_start = MPI_Wtime();
+        start_halo_exchange(&halo, &tile, p);
+        phase_times[HALO_WAIT] += MPI_Wtime() - phase_start;
+        phase_start = MPI_Wtime();
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            local_step_heat += compute_row(i, 2, n_columns - 1, n_columns, working_data_set, next_working_data_set);
+        }
+        phase_times[COMPUTE] += MPI_Wtime() - phase_start;
+        phase_start = MPI_Wtime();
+        finish_halo_exchange(&halo);
+        phase_times[HALO_WAIT] += MPI_Wtime() - phase_start;
+
+        /* Do the non-local computation on the border of the tile */
+        phase_start = MPI_Wtime();
+        local_step_heat += compute_row(1, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        if (n_rows > 1)
+        {
+            local_step_heat += compute_row(n_rows, 1, n_columns, n_columns, working_data_set, next_working_data_set);
+        }
+        for (int i = 2; i < n_rows; i = i + 1)
+        {
+            local_step_heat += compute_row(i, 1, 1, n_columns, working_data_set, next_working_data_set);
+            if (n_columns > 1)
+            {
+                local_step_heat += compute_row(i, n_columns, n_columns, n_columns, working_data_set,
+                                               next_working_data_set);
+            }
+        }
+        phase_times[COMPUTE] += MPI_Wtime() - phase_start;
+
+        /* Finish the previous diagnostic reduction, and start the
+         * next */
+        if ((step + 1) % reduce_interval == 0 || step + 1 == max_step)
+        {
+            phase_start = MPI_Wtime();
+            MPI_Wait(&reduction_request, MPI_STATUS_IGNORE);
+            local_heat = local_step_heat;
+            MPI_Iallreduce(&local_heat, &global_heat, 1, MPI_DOUBLE, MPI_SUM, comm, &reduction_request);
+            phase_times[REDUCTION_WAIT] += MPI_Wtime() - phase_start;
+        }
+
+        /* Prepare to iterate, either by copying the new values back
+         * like the first exercises did, or by swapping the buffers */
+        phase_start = MPI_Wtime();
+        if (variant == NONBLOCKING_COPY)
+        {
+            memcpy(tile.data_sets[0], tile.data_sets[1], sizeof(double) * (n_rows + 2) * (n_columns + 2));
+        }
+        else
+        {
+            p = 1 - p;
+        }
+        phase_times[COPY] += MPI_Wtime() - phase_start;
+    }
+    double phase_start = MPI_Wtime();
+    MPI_Wait(&reduction_request, MPI_STATUS_IGNORE);
+    phase_times[REDUCTION_WAIT] += MPI_Wtime() - phase_start;
+    const double local_elapsed = MPI_Wtime() - start_time;
+
+    /* Summarize the timings over the ranks */
+    double phase_sums[N_PHASES];
+    MPI_Allreduce(phase_times, result->phase_min, N_PHASES, MPI_DOUBLE, MPI_MIN, comm);
+    MPI_Allreduce(phase_times, result->phase_max, N_PHASES, MPI_DOUBLE, MPI_MAX, comm);
+    MPI_Allreduce(phase_times, phase_sums, N_PHASES, MPI_DOUBLE, MPI_SUM, comm);
+    for (int k = 0; k < N_PHASES; k = k + 1)
+    {
+        result->phase_avg[k] = phase_sums[k] / size;
+    }
+    MPI_Allreduce(&local_elapsed, &result->elapsed, 1, MPI_DOUBLE, MPI_MAX, comm);
+    result->variant = variant;
+    result->dims[0] = dims[0];
+    result->dims[1] = dims[1];
+    result->total_heat = global_heat;
+
+    uint64_t local_fingerprint = 0;
+    for (int i = 1; i <= n_rows; i = i + 1)
+    {
+        for (int j = 1; j <= n_columns; j = j + 1)
+        {
+            uint64_t bits;
+            memcpy(&bits, &tile.data_sets[p][INDEX(i, j, n_columns)], sizeof(bits));
+            const uint64_t position =
+                (uint64_t)(tile.row_offset + i - 1) * n_global_columns + tile.column_offset + j - 1;
+            local_fingerprint += bits * (2 * position + 1);
+        }
+    }
+    MPI_Allreduce(&local_fingerprint, &result->fingerprint, 1, MPI_UINT64_T, MPI_SUM, comm);
+
+    free_halo_exchange(&halo, &tile);
+}
+
+/* The figures that are derived from the timings */
+struct benchmark_rates
+{
+    double cell_updates_per_second, gflops, bandwidth, arithmetic_intensity, bandwidth_fraction;
+};
+
+void derive_rates(const struct benchmark_result *result, int n_global_rows, int width, int max_step,
+                  double peak_bandwidth, struct benchmark_rates *rates)
+{
+    const double bytes_per_cell = BYTES_PER_CELL + ((result->variant == NONBLOCKING_COPY) ? COPY_BYTES_PER_CELL : 0);
+    const double cell_updates = (double)n_global_rows * width * max_step;
+    rates->cell_updates_per_second = (result->elapsed > 0) ? cell_updates / result->elapsed : 0;
+    rates->gflops = rates->cell_updates_per_second * FLOPS_PER_CELL * 1e-9;
+    rates->bandwidth = rates->cell_updates_per_second * bytes_per_cell * 1e-9;
+    rates->arithmetic_intensity = FLOPS_PER_CELL / bytes_per_cell;
+    rates->bandwidth_fraction = (peak_bandwidth > 0) ? rates->bandwidth / peak_bandwidth : 0;
+}
+
+void print_header(enum output_format format)
+{
+    if (format == TEXT)
+    {
+        printf("%18s %7s %10s %14s %10s %10s %6s", "variant", "ranks", "time (s)", "updates/s", "GFLOP/s", "GB/s",
+               "F/B");
+        for (int p = 0; p < N_PHASES; p = p + 1)
+        {
+            printf(" %24s", phase_names[p]);
+        }
+        printf("\n");
+    }
+    else if (format == CSV)
+    {
+        printf("variant,ranks,rank_rows,rank_columns,rows,columns,steps,elapsed,cell_updates_per_second,gflops,"
+               "bandwidth_gbs,arithmetic_intensity,bandwidth_fraction");
+        for (int p = 0; p < N_PHASES; p = p + 1)
+        {
+            printf(",%s_min,%s_avg,%s_max", phase_names[p], phase_names[p], phase_names[p]);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("[\n");
+    }
+}
+
+void print_result(enum output_format format, const struct benchmark_result *result,
+                  const struct benchmark_rates *rates, int size, int n_global_rows, int width, int max_step,
+                  int is_last)
+{
+    if (format == TEXT)
+    {
+        char ranks[32];
+        snprintf(ranks, sizeof(ranks), "%dx%d", result->dims[0], result->dims[1]);
+        printf("%18s %7s %10.4g %14.6g %10.4g %10.4g %6.3f", variant_names[result->variant], ranks,
+               result->elapsed, rates->cell_updates_per_second, rates->gflops, rates->bandwidth,
+               rates->arithmetic_intensity);
+        for (int p = 0; p < N_PHASES; p = p + 1)
+        {
+            printf("  %7.2e/%7.2e/%7.2e", result->phase_min[p], result->phase_avg[p], result->phase_max[p]);
+        }
+        printf("\n");
+    }
+    else if (format == CSV)
+    {
+        printf("%s,%d,%d,%d,%d,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g", variant_names[result->variant], size,
+               result->dims[0], result->dims[1], n_global_rows, width, max_step, result->elapsed,
+               rates->cell_updates_per_second, rates->gflops, rates->bandwidth, rates->arithmetic_intensity,
+               rates->bandwidth_fraction);
+        for (int p = 0; p < N_PHASES; p = p + 1)
+        {
+            printf(",%.9g,%.9g,%.9g", result->phase_min[p], result->phase_avg[p], result->phase_max[p]);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("  {\"variant\": \"%s\", \"ranks\": %d, \"rank_grid\": [%d, %d], \"rows\": %d, \"columns\": %d, "
+               "\"steps\": %d, \"elapsed\": %.9g, \"cell_updates_per_second\": %.9g, \"gflops\": %.9g, "
+               "\"bandwidth_gbs\": %.9g, \"arithmetic_intensity\": %.9g, \"bandwidth_fraction\": %.9g",
+               variant_names[result->variant], size, result->dims[0], result->dims[1], n_global_rows, width,
+               max_step, result->elapsed, rates->cell_updates_per_second, rates->gflops, rates->bandwidth,
+               rates->arithmetic_intensity, rates->bandwidth_fraction);
+        for (int p = 0; p < N_PHASES; p = p + 1)
+        {
+            printf(", \"%s\": {\"min\": %.9g, \"avg\": %.9g, \"max\": %.9g}", phase_names[p],
+                   result->phase_min[p], result->phase_avg[p], result->phase_max[p]);
+        }
+        printf("}%s\n", is_last ? "" : ",");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* Initialize the MPI environment */
+    MPI_Init(&argc, &argv);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /* Read the global grid size, the number of steps, how often the
+     * diagnostic reduction runs, and how to report. With the peak
+     * memory bandwidth of a rank's share of the node in GB/s, the
+     * fraction of the bandwidth roofline that was reached is reported
+     * too. Text and CSV or JSON go to stdout, and only the text has
+     * anything around the measurements. */
+    int n_global_rows = 2048, width = 2048, max_step = 100, reduce_interval = 1;
+    enum output_format format = TEXT;
+    double peak_bandwidth = 0;
+    int n_arguments = 0, arguments[3];
+    for (int k = 1; k < argc; k = k + 1)
+    {
+        if (strcmp(argv[k], "--format") == 0 && k + 1 < argc &&
+            (strcmp(argv[k + 1], "text") == 0 || strcmp(argv[k + 1], "csv") == 0 ||
+             strcmp(argv[k + 1], "json") == 0))
+        {
+            format = (strcmp(argv[k + 1], "csv") == 0) ? CSV : (strcmp(argv[k + 1], "json") == 0) ? JSON : TEXT;
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--reduce-every") == 0 && k + 1 < argc)
+        {
+            reduce_interval = atoi(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (strcmp(argv[k], "--peak-bandwidth") == 0 && k + 1 < argc)
+        {
+            peak_bandwidth = atof(argv[k + 1]);
+            k = k + 1;
+        }
+        else if (n_arguments < 3 && strncmp(argv[k], "--", 2) != 0)
+        {
+            arguments[n_arguments] = atoi(argv[k]);
+            n_arguments = n_arguments + 1;
+        }
+        else
+        {
+            n_arguments = -1;
+            break;
+        }
+    }
+    if (n_arguments == 3)
+    {
+        n_global_rows = arguments[0];
+        width = arguments[1];
+        max_step = arguments[2];
+    }
+
+    /* The ring variants run on a periodic column of ranks, and the 2D
+     * ones on a periodic grid of ranks */
+    int ring_dims[2] = {size, 1}, grid_dims[2] = {0, 0}, periods[2] = {1, 1};
+    MPI_Dims_create(size, 2, grid_dims);
+    if ((n_arguments != 0 && n_arguments != 3) || n_global_rows < size || width < grid_dims[1] || max_step < 1 ||
+        reduce_interval < 1)
+    {
+        if (rank == 0)
+        {
+            fprintf(stderr, "Usage: %s [n_rows n_columns n_steps] [--format text|csv|json] [--reduce-every N] "
+                            "[--peak-bandwidth GB/s]\nwith at least one row per rank\n", argv[0]);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Comm ring_comm, grid_comm;
+    MPI_Cart_create(MPI_COMM_WORLD, 2, ring_dims, periods, 0, &ring_comm);
+    MPI_Cart_create(MPI_COMM_WORLD, 2, grid_dims, periods, 0, &grid_comm);
+    MPI_Comm graph_comm = create_halo_graph(grid_comm);
+
+    if (rank == 0)
+    {
+        if (format == TEXT)
+        {
+            printf("Stencil on a %d x %d grid on %d ranks, %d steps, reducing every %d steps\n",
+                   n_global_rows, width, size, max_step, reduce_interval);
+            printf("Phase times are the totals per rank as min/avg/max over ranks, in seconds\n");
+        }
+        print_header(format);
+    }
+
+    /* Run each variant, and check that they all give the same grid, and
+     * conserve the total heat */
+    double initial_heat = 0;
+    for (int i = 0; i < n_global_rows; i = i + 1)
+    {
+        for (int j = 0; j < width; j = j + 1)
+        {
+            initial_heat += (double)((i + 2 * j) % 7);
+        }
+    }
+    uint64_t reference_fingerprint = 0;
+    int success = 1;
+    for (int v = 0; v < N_VARIANTS; v = v + 1)
+    {
+        struct benchmark_result result;
+        struct benchmark_rates rates;
+        run_variant((enum variant)v, max_step, reduce_interval, n_global_rows, width,
+                    is_2d((enum variant)v) ? grid_comm : ring_comm, graph_comm, &result);
+        derive_rates(&result, n_global_rows, width, max_step, peak_bandwidth, &rates);
+        if (v == 0)
+        {
+            reference_fingerprint = result.fingerprint;
+        }
+        success = success && (result.fingerprint == reference_fingerprint);
+        success = success && (fabs(result.total_heat - initial_heat) <= 1e-9 * initial_heat);
+        if (rank == 0)
+        {
+            print_result(format, &result, &rates, size, n_global_rows, width, max_step, v == N_VARIANTS - 1);
+        }
+    }
+
+    /* Report whether the code is correct. The machine-readable formats
+     * only carry it in the exit status. Every rank saw the same
+     * fingerprints and heat, so they all agree. */
+    if (rank == 0)
+    {
+        if (format == JSON)
+        {
+            printf("]\n");
+        }
+        else if (format == TEXT)
+        {
+            if (success)
+            {
+                printf("SUCCESS on rank %d!\n", rank);
+            }
+            else
+            {
+                printf("Improvement needed before rank %d can report success!\n", rank);
+            }
+        }
+    }
+
+    /* Clean up and exit */
+    MPI_Comm_free(&graph_comm);
+    MPI_Comm_free(&grid_comm);
+    MPI_Comm_free(&ring_comm);
+    MPI_Finalize();
+    return success ? 0 : 1;
+}